@@ -0,0 +1,104 @@
+/**
+ * Copyright (C) 2021 S.Fuchita (@soramimi_jp)
+ * MIT License
+ */
+
+#include "clock.h"
+#include "pico/stdlib.h"
+
+#define CLOCK_FLL_MIN_INTERVAL 16000000 // us, shorter intervals give too noisy a frequency
+
+struct clock_state_t {
+	bool set;
+	uint64_t base_local; // time_us_64() of the last update
+	uint64_t base_time; // disciplined time at base_local
+	int32_t frequency; // ppb
+	int64_t slew; // phase correction not applied yet at base_local
+	uint64_t epoch; // time_us_64() the last offset was measured at
+};
+
+static struct clock_state_t _clock;
+
+void clock_init()
+{
+	_clock.set = false;
+	_clock.base_local = time_us_64();
+	_clock.base_time = _clock.base_local;
+	_clock.frequency = 0;
+	_clock.slew = 0;
+}
+
+// part of the pending phase correction applied after elapsed microseconds
+static int64_t clock_slewed(int64_t slew, uint64_t elapsed)
+{
+	int64_t max = elapsed / (1000000 / CLOCK_SLEW_RATE);
+	if (slew > max) {
+		return max;
+	}
+	if (slew < -max) {
+		return -max;
+	}
+	return slew;
+}
+
+static uint64_t clock_at(uint64_t local)
+{
+	uint64_t elapsed = local - _clock.base_local;
+	return _clock.base_time + elapsed + (int64_t)elapsed * _clock.frequency / 1000000000 + clock_slewed(_clock.slew, elapsed);
+}
+
+uint64_t clock_now_us()
+{
+	return clock_at(time_us_64());
+}
+
+bool clock_is_set()
+{
+	return _clock.set;
+}
+
+int64_t clock_pending()
+{
+	int64_t elapsed = time_us_64() - _clock.base_local;
+	return _clock.slew - clock_slewed(_clock.slew, elapsed);
+}
+
+// offsets are measured against the clock as it reads once the pending correction is done,
+// so whatever is left accumulated from the frequency error since the previous measurement
+void clock_update(int64_t offset, int64_t age)
+{
+	uint64_t local = time_us_64();
+	uint64_t epoch = local - age;
+	int64_t elapsed = epoch - _clock.epoch;
+	int64_t phase = clock_pending() + offset;
+
+	// restart from the current reading, the clock stays continuous
+	_clock.base_time = clock_at(local);
+	_clock.base_local = local;
+
+	if (!_clock.set || phase > CLOCK_STEP_THRESHOLD || phase < -CLOCK_STEP_THRESHOLD) {
+		_clock.base_time += phase;
+		_clock.slew = 0;
+		_clock.epoch = epoch;
+		_clock.set = true;
+		return;
+	}
+
+	if (elapsed >= CLOCK_FLL_MIN_INTERVAL) {
+		int64_t f = _clock.frequency + offset * 1000000000 / elapsed / 2;
+		if (f > CLOCK_FREQUENCY_MAX) {
+			f = CLOCK_FREQUENCY_MAX;
+		} else if (f < -CLOCK_FREQUENCY_MAX) {
+			f = -CLOCK_FREQUENCY_MAX;
+		}
+		_clock.frequency = f;
+	}
+
+	_clock.epoch = epoch;
+	_clock.slew = phase;
+}
+
+int32_t clock_frequency()
+{
+	return _clock.frequency;
+}
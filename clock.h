@@ -0,0 +1,29 @@
+/**
+ * Copyright (C) 2021 S.Fuchita (@soramimi_jp)
+ * MIT License
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef CLOCK_STEP_THRESHOLD
+#define CLOCK_STEP_THRESHOLD 128000 // us, larger offsets are stepped instead of slewed
+#endif
+
+#ifndef CLOCK_SLEW_RATE
+#define CLOCK_SLEW_RATE 500 // ppm, phase corrections are spread over time at this rate
+#endif
+
+#define CLOCK_FREQUENCY_MAX 500000 // ppb
+
+void clock_init();
+uint64_t clock_now_us(); // disciplined, microseconds since 1900, monotonic between steps
+bool clock_is_set();
+void clock_update(int64_t offset, int64_t age); // microseconds, relative to clock_now_us() + clock_pending(), measured age us ago
+int64_t clock_pending(); // part of the phase correction not slewed yet, microseconds
+int32_t clock_frequency(); // estimated correction of the local timebase, ppb
+
+#endif
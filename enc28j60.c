@@ -6,219 +6,387 @@
 #include "enc28j60.h"
 #include "ip.h"
 #include "pico/stdlib.h"
+#include <string.h>
 
 uint16_t _enc28j60_next_packet_ptr;
+static uint16_t _enc28j60_rx_next; // next packet pointer of the frame being received
+static int _enc28j60_rx_remain;
+static int _enc28j60_tx_buffer; // transmit buffer the next frame is written to
+int _enc28j60_rx_filter = ENC28J60_FILTER_ARP;
+static struct enc28j60_stats_t _enc28j60_stats;
 
-int enc28j60_read_control_e(int reg)
+#if ENC28J60_RX_DMA
+static uint8_t _enc28j60_rx_slot[2][MAX_FRAME_SIZE];
+static uint16_t _enc28j60_rx_slot_len[2];
+static int _enc28j60_rx_filling = -1; // slot being filled by DMA
+static int _enc28j60_rx_ready = -1; // slot holding a complete frame
+#endif
+
+static int _enc28j60_bank = -1; // bank currently selected in ECON1, -1: unknown
+
+void enc28j60_select_bank(int n);
+
+static void enc28j60_set_bank(int reg)
 {
-	int t;
-	enc28j60_cs(0);
-	enc28j60_io(reg);
-	t = enc28j60_io(0);
-	enc28j60_cs(1);
-	return t;
+	if ((reg & ADDR_MASK) < (EIE & ADDR_MASK)) { // common registers are visible in every bank
+		enc28j60_select_bank((reg & BANK_MASK) >> 5);
+	}
 }
 
-int enc28j60_read_control_m(int reg)
+int enc28j60_read_control(int reg)
 {
-	int t;
-	enc28j60_cs(0);
-	enc28j60_io(reg);
-	enc28j60_io(reg); // 1 more
-	t = enc28j60_io(0);
-	enc28j60_cs(1);
-	return t;
+	uint8_t rx[2];
+	int n = (reg & MREG) ? 2 : 1; // MAC and MII registers shift out a dummy byte first
+	enc28j60_set_bank(reg);
+	enc28j60_transfer(reg & ADDR_MASK, 0, rx, n);
+	return rx[n - 1];
 }
 
 int enc28j60_read_buffer()
 {
-	int t;
-	enc28j60_cs(0);
-	enc28j60_io(0x3a);
-	t = enc28j60_io(0);
-	enc28j60_cs(1);
+	uint8_t t;
+	enc28j60_transfer(0x3a, 0, &t, 1);
+	return t;
 }
 
 void enc28j60_write_control(int reg, int val)
 {
-	enc28j60_cs(0);
-	enc28j60_io(0x40 | reg);
-	enc28j60_io(val);
-	enc28j60_cs(1);
+	uint8_t t = val;
+	enc28j60_set_bank(reg);
+	enc28j60_transfer(0x40 | (reg & ADDR_MASK), &t, 0, 1);
 }
 
-int enc28j60_write_buffer(int val)
+void enc28j60_write_buffer(int val)
 {
-	enc28j60_cs(0);
-	enc28j60_io(0x7a);
-	enc28j60_io(val);
-	enc28j60_cs(1);
+	uint8_t t = val;
+	enc28j60_transfer(0x7a, &t, 0, 1);
 }
 
-int enc28j60_bit_set(int reg, int val)
+void enc28j60_bit_set(int reg, int val)
 {
-	enc28j60_cs(0);
-	enc28j60_io(0x80 | reg);
-	enc28j60_io(val);
-	enc28j60_cs(1);
+	uint8_t t = val;
+	enc28j60_set_bank(reg);
+	enc28j60_transfer(0x80 | (reg & ADDR_MASK), &t, 0, 1);
 }
 
-int enc28j60_bit_clr(int reg, int val)
+void enc28j60_bit_clr(int reg, int val)
 {
-	enc28j60_cs(0);
-	enc28j60_io(0xa0 | reg);
-	enc28j60_io(val);
-	enc28j60_cs(1);
+	uint8_t t = val;
+	enc28j60_set_bank(reg);
+	enc28j60_transfer(0xa0 | (reg & ADDR_MASK), &t, 0, 1);
 }
 
-int enc28j60_reset()
+void enc28j60_reset()
 {
-	enc28j60_cs(0);
-	enc28j60_io(0xff);
-	enc28j60_cs(1);
+	enc28j60_transfer(0xff, 0, 0, 0);
+	_enc28j60_bank = 0; // ECON1 resets to bank 0
 }
 
 void enc28j60_select_bank(int n)
 {
-	enc28j60_bit_clr(ECON1, 0x03);
-	enc28j60_bit_set(ECON1, n & 0x03);
+	int clr;
+	int set;
+
+	n &= 0x03;
+	if (n == _enc28j60_bank) {
+		return;
+	}
+	clr = 0x03 & ~n;
+	set = n;
+	if (_enc28j60_bank >= 0) {
+		clr = _enc28j60_bank & ~n;
+		set = n & ~_enc28j60_bank;
+	}
+	if (clr) {
+		enc28j60_bit_clr(ECON1, clr);
+	}
+	if (set) {
+		enc28j60_bit_set(ECON1, set);
+	}
+	_enc28j60_bank = n;
 }
 
 void enc28j60_write_phy(int reg, int val)
 {
-	enc28j60_select_bank(2);
 	enc28j60_write_control(MIREGADR, reg);
 	enc28j60_write_control(MIWRL, val & 0xff);
 	enc28j60_write_control(MIWRH, val >> 8);
-	while (enc28j60_read_control_m(MISTAT) & 0x01);
+	while (enc28j60_read_control(MISTAT) & 0x01);
 }
 
-void enc28j60_send_packet(uint8_t const *ptr, int len)
+// errata: ERXRDPT must be odd, so it is kept one byte behind the next frame
+static void enc28j60_set_rx_read_pointer(uint16_t next)
 {
-	int i;
-
-	if (len < 0 || len > MAX_FRAME_SIZE) {
-		return;
-	}
+	uint16_t ptr = next == RXST_INIT ? RXND_INIT : next - 1;
+	enc28j60_write_control(ERXRDPTL, ptr & 0xff);
+	enc28j60_write_control(ERXRDPTH, ptr >> 8);
+}
 
-	enc28j60_select_bank(0);
+static void enc28j60_rx_init()
+{
+	enc28j60_write_control(ERXSTL, RXST_INIT & 0xff);
+	enc28j60_write_control(ERXSTH, RXST_INIT >> 8);
+	enc28j60_write_control(ERXNDL, RXND_INIT & 0xff);
+	enc28j60_write_control(ERXNDH, RXND_INIT >> 8);
+	enc28j60_set_rx_read_pointer(RXST_INIT);
+	_enc28j60_next_packet_ptr = RXST_INIT;
+	_enc28j60_rx_remain = 0;
+}
 
-	while (enc28j60_read_control_e(ECON1) & 0x08); // while ECON1.TXRTS == 1
+// the ring can no longer be walked, throw away everything in it
+static void enc28j60_rx_reset()
+{
+	_enc28j60_stats.rx_resets++;
+	enc28j60_bit_clr(ECON1, 0x04); // clear RXEN
+	enc28j60_bit_set(ECON1, 0x40); // set RXRST
+	enc28j60_bit_clr(ECON1, 0x40); // clear RXRST
+	enc28j60_rx_init();
+	while (enc28j60_read_control(EPKTCNT) != 0) {
+		enc28j60_bit_set(ECON2, 0x40); // set PKTDEC
+	}
+	enc28j60_bit_clr(EIR, 0x41); // clear PKTIF, RXERIF
+	enc28j60_bit_set(ECON1, 0x04); // set RXEN
+}
 
-	enc28j60_write_control(ETXSTL, TXST_INIT & 0xff);
-	enc28j60_write_control(ETXSTH, TXST_INIT >> 8);
+static int enc28j60_packet_count()
+{
+	int n;
+	if (!enc28j60_irq_pending()) {
+		return 0; // INT is idle, no need to touch SPI
+	}
+	// RXERIF: a frame was aborted because the ring was full or EPKTCNT reached 255
+	if (enc28j60_read_control(EIR) & 0x01) {
+		_enc28j60_stats.rx_overflows++;
+		enc28j60_bit_clr(EIR, 0x01);
+	}
+	n = enc28j60_read_control(EPKTCNT);
+	if (n > _enc28j60_stats.rx_pending_max) {
+		_enc28j60_stats.rx_pending_max = n;
+	}
+	if (n == 0) {
+		enc28j60_irq_clear();
+	}
+	return n;
+}
 
-	enc28j60_write_control(EWRPTL, TXST_INIT & 0xff);
-	enc28j60_write_control(EWRPTH, TXST_INIT >> 8);
+// checksum of buffer memory begin..end (inclusive) computed by the DMA controller
+static uint16_t enc28j60_dma_checksum(uint16_t begin, uint16_t end)
+{
+	enc28j60_write_control(EDMASTL, begin & 0xff);
+	enc28j60_write_control(EDMASTH, begin >> 8);
+	enc28j60_write_control(EDMANDL, end & 0xff);
+	enc28j60_write_control(EDMANDH, end >> 8);
+	enc28j60_bit_set(ECON1, 0x30); // set CSUMEN, DMAST
+	while (enc28j60_read_control(ECON1) & 0x20); // while ECON1.DMAST == 1
+	enc28j60_bit_clr(ECON1, 0x10); // clear CSUMEN
+	return (enc28j60_read_control(EDMACSH) << 8) | enc28j60_read_control(EDMACSL);
+}
 
-	enc28j60_write_control(ETXNDL, (TXST_INIT + len) & 0xff);
-	enc28j60_write_control(ETXNDH, (TXST_INIT + len) >> 8);
+// adds a partial sum of data outside the buffer to a checksum
+static uint16_t enc28j60_checksum_add(uint16_t csum, uint32_t sum)
+{
+	sum += (uint16_t)~csum;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
 
-	enc28j60_cs(0);
-	enc28j60_io(0x7a);
-	enc28j60_io(0x00);
-	for (i = 0; i < len; i++) {
-		enc28j60_io(ptr[i]);
+#if IP_CHECKSUM_OFFLOAD
+static uint16_t enc28j60_rx_addr(uint32_t addr)
+{
+	if (addr > RXND_INIT) {
+		addr -= RXND_INIT - RXST_INIT + 1;
 	}
-	enc28j60_cs(1);
+	return addr;
+}
 
-	enc28j60_bit_clr(EIR, 0x08);
-	enc28j60_bit_set(EIE, 0x08);
-	enc28j60_bit_set(ECON1, 0x08);
+// verifies the ip header and udp checksums of the frame still held in the receive buffer
+static bool enc28j60_recv_verify(uint8_t const *frame, int len)
+{
+	uint32_t base = _enc28j60_next_packet_ptr + 6; // behind the next pointer and status vector
+	uint8_t const *udp;
+	uint32_t sum;
+	int hl;
+	int n;
+
+	if (len < 14 + 20 || frame[12] != 0x08 || frame[13] != 0x00) {
+		return true; // not ipv4
+	}
+	hl = (frame[14] & 0x0f) * 4;
+	if (hl < 20 || 14 + hl > len) {
+		return false;
+	}
+	if (enc28j60_dma_checksum(enc28j60_rx_addr(base + 14), enc28j60_rx_addr(base + 14 + hl - 1)) != 0) {
+		return false;
+	}
+	if (frame[14 + 9] != 17 || 14 + hl + 8 > len) {
+		return true;
+	}
+	udp = frame + 14 + hl;
+	if (udp[6] == 0 && udp[7] == 0) {
+		return true; // checksum not used
+	}
+	n = (udp[4] << 8) | udp[5];
+	if (n < 8 || 14 + hl + n > len) {
+		return false;
+	}
+	// pseudo header: source, destination, protocol, udp length
+	sum = ((frame[26] << 8) | frame[27]) + ((frame[28] << 8) | frame[29]);
+	sum += ((frame[30] << 8) | frame[31]) + ((frame[32] << 8) | frame[33]);
+	sum += 17 + n;
+	return enc28j60_checksum_add(enc28j60_dma_checksum(enc28j60_rx_addr(base + 14 + hl), enc28j60_rx_addr(base + 14 + hl + n - 1)), sum) == 0;
 }
+#endif
 
-int enc28j60_peek_packet()
+int enc28j60_recv_begin()
 {
-	uint16_t next;
+	uint8_t hdr[6];
 	uint16_t len;
 	uint16_t stat;
 
-	enc28j60_select_bank(1);
-	if (enc28j60_read_control_e(EPKTCNT) == 0) {
+	if (enc28j60_packet_count() == 0) {
 		return 0;
 	}
 
-	enc28j60_select_bank(0);
 	enc28j60_write_control(ERDPTL, _enc28j60_next_packet_ptr & 0xff);
 	enc28j60_write_control(ERDPTH, _enc28j60_next_packet_ptr >> 8);
 
-	enc28j60_cs(0);
-	enc28j60_io(0x3a);
-	next = enc28j60_io(0);
-	next |= enc28j60_io(0) << 8;
-	len = enc28j60_io(0);
-	len |= enc28j60_io(0) << 8;
-	stat = enc28j60_io(0);
-	stat |= enc28j60_io(0) << 8;
-	enc28j60_cs(1);
+	enc28j60_transfer(0x3a, 0, hdr, 6);
+	_enc28j60_rx_next = hdr[0] | (hdr[1] << 8);
+	len = hdr[2] | (hdr[3] << 8);
+	stat = hdr[4] | (hdr[5] << 8);
 
-	if (len < 6 + 6 + 2 + 4) {
-		len = -1;
-	} else {
-		len -= 4;
+	// frames start on even addresses inside the ring, anything else means we lost track of it
+	if (_enc28j60_rx_next > RXND_INIT || (_enc28j60_rx_next & 1)) {
+		enc28j60_rx_reset();
+		return -1;
 	}
 
+	// receive status vector bit 23: received ok, bit 21: length check error, bit 20: crc error
+	// (bit 22 "length out of range" is set for every type field frame, so it is not checked)
+	if (!(stat & 0x80) || (stat & 0x30) || len < 6 + 6 + 2 + 4 || len > MAX_FRAME_SIZE + 4) {
+		_enc28j60_stats.rx_errors++;
+		enc28j60_recv_end();
+		return -1;
+	}
+
+	// ERDPT now points to the frame data, enc28j60_recv_read() continues from there
+	_enc28j60_rx_remain = len - 4;
+	return _enc28j60_rx_remain;
+}
+
+int enc28j60_recv_read(uint8_t *ptr, int len)
+{
+	if (len > _enc28j60_rx_remain) {
+		len = _enc28j60_rx_remain;
+	}
+	if (len <= 0) {
+		return 0;
+	}
+	enc28j60_transfer(0x3a, 0, ptr, len);
+	_enc28j60_rx_remain -= len;
 	return len;
 }
 
-void enc28j60_recv_packet(uint8_t *ptr, int maxlen)
+void enc28j60_recv_end()
 {
-	int i;
-	uint16_t next;
-	uint16_t len;
-	uint16_t stat;
+	enc28j60_set_rx_read_pointer(_enc28j60_rx_next);
+	_enc28j60_next_packet_ptr = _enc28j60_rx_next;
+	_enc28j60_rx_remain = 0;
 
-	enc28j60_select_bank(0);
-	enc28j60_write_control(ERDPTL, _enc28j60_next_packet_ptr & 0xff);
-	enc28j60_write_control(ERDPTH, _enc28j60_next_packet_ptr >> 8);
+	enc28j60_bit_set(ECON2, 0x40); // set PKTDEC
+}
 
-	enc28j60_cs(0);
-	enc28j60_io(0x3a);
-	next = enc28j60_io(0);
-	next |= enc28j60_io(0) << 8;
-	len = enc28j60_io(0);
-	len |= enc28j60_io(0) << 8;
-	stat = enc28j60_io(0);
-	stat |= enc28j60_io(0) << 8;
-	if (len < 4) {
-		len = 0;
-	} else {
-		len -= 4;
-		for (i = 0; i < len; i++) {
-			uint8_t c = enc28j60_io(0);
-			if (i < maxlen) {
-				ptr[i] = c;
-			}
-		}
+#if ENC28J60_RX_DMA
+static void enc28j60_rx_dma_finish()
+{
+	if (_enc28j60_rx_filling < 0) {
+		return;
 	}
-	enc28j60_cs(1);
+	enc28j60_transfer_wait();
+#if IP_CHECKSUM_OFFLOAD
+	if (!enc28j60_recv_verify(_enc28j60_rx_slot[_enc28j60_rx_filling], _enc28j60_rx_slot_len[_enc28j60_rx_filling])) {
+		_enc28j60_stats.rx_checksum_errors++;
+		enc28j60_recv_end();
+		_enc28j60_rx_filling = -1;
+		return;
+	}
+#endif
+	enc28j60_recv_end();
+	_enc28j60_rx_ready = _enc28j60_rx_filling;
+	_enc28j60_rx_filling = -1;
+}
+
+static void enc28j60_rx_dma_start(int slot)
+{
+	int len;
 
-	enc28j60_write_control(ERXRDPTL, next & 0xff);
-	enc28j60_write_control(ERXRDPTH, next >> 8);
-	_enc28j60_next_packet_ptr = next;
+	while ((len = enc28j60_recv_begin()) < 0); // skip bad frames
+	if (len == 0) {
+		return;
+	}
 
-	enc28j60_bit_set(ECON2, 0x40); // set PKTDEC
+	// the transaction stays open until enc28j60_rx_dma_finish()
+	enc28j60_transfer_start(0x3a, _enc28j60_rx_slot[slot], len);
+	_enc28j60_rx_remain = 0;
+	_enc28j60_rx_slot_len[slot] = len;
+	_enc28j60_rx_filling = slot;
 }
+#endif
 
-void enc28j60_drop_packet()
+void enc28j60_send_packet_csum(uint8_t const *ptr, int len, struct eth_checksum_t const *csum, int count)
 {
-	uint16_t next;
+	uint16_t start;
+	uint16_t v;
+	int i;
 
-	enc28j60_select_bank(0);
-	enc28j60_write_control(ERDPTL, _enc28j60_next_packet_ptr & 0xff);
-	enc28j60_write_control(ERDPTH, _enc28j60_next_packet_ptr >> 8);
+	if (len < 0 || len > MAX_FRAME_SIZE) {
+		return;
+	}
 
-	enc28j60_cs(0);
-	enc28j60_io(0x3a);
-	next = enc28j60_io(0);
-	next |= enc28j60_io(0) << 8;
-	enc28j60_cs(1);
+#if ENC28J60_RX_DMA
+	enc28j60_rx_dma_finish();
+#endif
 
-	enc28j60_write_control(ERXRDPTL, next & 0xff);
-	enc28j60_write_control(ERXRDPTH, next >> 8);
-	_enc28j60_next_packet_ptr = next;
+	// the previous frame may still be going out of the other buffer
+	start = TXST_INIT + _enc28j60_tx_buffer * TX_BUFFER_SIZE;
 
-	enc28j60_bit_set(ECON2, 0x40); // set PKTDEC
+	enc28j60_write_control(EWRPTL, start & 0xff);
+	enc28j60_write_control(EWRPTH, start >> 8);
+
+	enc28j60_write_buffer(0x00); // per packet control byte
+	enc28j60_transfer(0x7a, ptr, 0, len);
+
+	for (i = 0; i < count; i++) {
+		// the frame starts behind the per packet control byte
+		v = enc28j60_dma_checksum(start + 1 + csum[i].begin, start + csum[i].end);
+		v = enc28j60_checksum_add(v, csum[i].sum);
+		if (v == 0) {
+			v = 0xffff;
+		}
+		enc28j60_write_control(EWRPTL, (start + 1 + csum[i].field) & 0xff);
+		enc28j60_write_control(EWRPTH, (start + 1 + csum[i].field) >> 8);
+		enc28j60_write_buffer(v >> 8);
+		enc28j60_write_buffer(v & 0xff);
+	}
+
+	while (enc28j60_read_control(ECON1) & 0x08); // while ECON1.TXRTS == 1
+
+	enc28j60_write_control(ETXSTL, start & 0xff);
+	enc28j60_write_control(ETXSTH, start >> 8);
+
+	enc28j60_write_control(ETXNDL, (start + len) & 0xff);
+	enc28j60_write_control(ETXNDH, (start + len) >> 8);
+
+	enc28j60_bit_clr(EIR, 0x08);
+	enc28j60_bit_set(ECON1, 0x08);
+
+	_enc28j60_tx_buffer ^= 1;
+}
+
+void enc28j60_send_packet(uint8_t const *ptr, int len)
+{
+	enc28j60_send_packet_csum(ptr, len, 0, 0);
 }
 
 void enc28j60_init(uint8_t const *macaddr)
@@ -229,25 +397,18 @@ void enc28j60_init(uint8_t const *macaddr)
 	enc28j60_reset();
 	sleep_ms(1);
 
-	while (!(enc28j60_read_control_e(ESTAT) & 0x01)); // while ESTAT.CLKRDY == 0
+	while (!(enc28j60_read_control(ESTAT) & 0x01)); // while ESTAT.CLKRDY == 0
 
-	_enc28j60_next_packet_ptr = RXST_INIT;
+	_enc28j60_tx_buffer = 0;
 
 	// initialize buffer
 	enc28j60_write_control(ETXSTL, TXST_INIT & 0xff);
 	enc28j60_write_control(ETXSTH, TXST_INIT >> 8);
 	enc28j60_write_control(ETXNDL, TXST_INIT & 0xff);
 	enc28j60_write_control(ETXNDH, TXST_INIT >> 8);
-	enc28j60_write_control(ERXSTL, RXST_INIT & 0xff);
-	enc28j60_write_control(ERXSTH, RXST_INIT > 8);
-	enc28j60_write_control(ERXNDL, (TXST_INIT - 1) & 0xff);
-	enc28j60_write_control(ERXNDH, (TXST_INIT - 1) >> 8);
-
-	enc28j60_write_control(ERXRDPTL, RXST_INIT & 0xff);
-	enc28j60_write_control(ERXRDPTH, RXST_INIT >> 8);
+	enc28j60_rx_init();
 
 	// initialize MAC
-	enc28j60_select_bank(2);
 	enc28j60_write_control(MACON1, 0x0d);
 	enc28j60_write_control(MACON3, 0x33);
 	enc28j60_write_control(MACON4, 0x00);
@@ -258,7 +419,6 @@ void enc28j60_init(uint8_t const *macaddr)
 	enc28j60_write_control(MAIPGH, 0x0c);
 
 	// initialize address
-	enc28j60_select_bank(3);
 	enc28j60_write_control(MAADR1, macaddr[0]);
 	enc28j60_write_control(MAADR2, macaddr[1]);
 	enc28j60_write_control(MAADR3, macaddr[2]);
@@ -270,31 +430,142 @@ void enc28j60_init(uint8_t const *macaddr)
 	enc28j60_write_phy(PHCON1, 0x0100); // PDPXMD
 	enc28j60_write_phy(PHLCON, 0x0742);
 
+	// initialize receive filter
+	// pattern match: destination ff:ff:ff:ff:ff:ff (bytes 0-5) and type 0x0806 (bytes 12-13)
+	enc28j60_write_control(EPMM0, 0x3f);
+	enc28j60_write_control(EPMM1, 0x30);
+	enc28j60_write_control(EPMCSL, 0xf9); // ~(0xffff + 0xffff + 0xffff + 0x0806)
+	enc28j60_write_control(EPMCSH, 0xf7);
+	enc28j60_write_control(EPMOL, 0);
+	enc28j60_write_control(EPMOH, 0);
+	enc28j60_write_control(ERXFCON, 0xa0 | _enc28j60_rx_filter); // UCEN, CRCEN, OR
+
+	// INT follows PKTIF and RXERIF, so it stays asserted while EPKTCNT != 0 or an overflow is unhandled
+	if (enc28j60_irq_enabled()) {
+		enc28j60_bit_set(EIE, 0xc1); // set INTIE, PKTIE, RXERIE
+	}
+
 	//
 	enc28j60_bit_set(ECON1, 0x04); // set RXEN
 }
 
+void enc28j60_add_rx_filter(int filter)
+{
+#if ENC28J60_RX_DMA
+	enc28j60_rx_dma_finish();
+#endif
+	_enc28j60_rx_filter |= filter;
+	enc28j60_write_control(ERXFCON, 0xa0 | _enc28j60_rx_filter);
+}
+
+void enc28j60_remove_rx_filter(int filter)
+{
+#if ENC28J60_RX_DMA
+	enc28j60_rx_dma_finish();
+#endif
+	_enc28j60_rx_filter &= ~filter;
+	enc28j60_write_control(ERXFCON, 0xa0 | _enc28j60_rx_filter);
+}
+
+void enc28j60_get_stats(struct enc28j60_stats_t *stats)
+{
+	*stats = _enc28j60_stats;
+}
+
+void enc28j60_reset_stats()
+{
+	memset(&_enc28j60_stats, 0, sizeof(_enc28j60_stats));
+}
+
+static int eth_filter_to_enc28j60(int filter)
+{
+	int f = 0;
+	if (filter & ETH_FILTER_BROADCAST) {
+		f |= ENC28J60_FILTER_BROADCAST;
+	}
+	if (filter & ETH_FILTER_MULTICAST) {
+		f |= ENC28J60_FILTER_MULTICAST;
+	}
+	if (filter & ETH_FILTER_ARP) {
+		f |= ENC28J60_FILTER_ARP;
+	}
+	return f;
+}
+
 void eth_init(uint8_t const *macaddr)
 {
 	enc28j60_init(macaddr);
 }
 
+#if ENC28J60_RX_DMA
 unsigned int eth_recv_packet(void *ptr, int maxlen)
 {
-	int len = enc28j60_peek_packet();
-	if (len == 0) {
-		return 0;
-	}
-	if (len < 0) {
-		enc28j60_drop_packet();
-		return 0;
+	int slot;
+	int len;
+
+	enc28j60_rx_dma_finish();
+	while (_enc28j60_rx_ready < 0) {
+		enc28j60_rx_dma_start(0);
+		if (_enc28j60_rx_filling < 0) {
+			return 0;
+		}
+		enc28j60_rx_dma_finish();
 	}
-	enc28j60_recv_packet((uint8_t *)ptr, maxlen);
+	slot = _enc28j60_rx_ready;
+	_enc28j60_rx_ready = -1;
+
+	// the next frame is clocked into the other slot while the caller parses this one
+	enc28j60_rx_dma_start(slot ^ 1);
+
+	len = _enc28j60_rx_slot_len[slot];
+	_enc28j60_stats.rx_frames++;
+	memcpy(ptr, _enc28j60_rx_slot[slot], len < maxlen ? len : maxlen);
 	return len;
 }
+#else
+unsigned int eth_recv_packet(void *ptr, int maxlen)
+{
+	int len;
+	while (1) {
+		len = enc28j60_recv_begin();
+		if (len == 0) {
+			return 0;
+		}
+		if (len < 0) {
+			continue; // dropped
+		}
+		enc28j60_recv_read((uint8_t *)ptr, len < maxlen ? len : maxlen);
+#if IP_CHECKSUM_OFFLOAD
+		if (!enc28j60_recv_verify((uint8_t const *)ptr, len < maxlen ? len : maxlen)) {
+			_enc28j60_stats.rx_checksum_errors++;
+			enc28j60_recv_end();
+			continue;
+		}
+#endif
+		enc28j60_recv_end();
+		_enc28j60_stats.rx_frames++;
+		return len;
+	}
+}
+#endif
 
 void eth_send_packet(void const *ptr, unsigned int len)
 {
 	enc28j60_send_packet((uint8_t const *)ptr, len);
 }
 
+void eth_send_packet_csum(void const *ptr, unsigned int len, struct eth_checksum_t const *csum, int count)
+{
+	enc28j60_send_packet_csum((uint8_t const *)ptr, len, csum, count);
+}
+
+void eth_add_filter(int filter)
+{
+	enc28j60_add_rx_filter(eth_filter_to_enc28j60(filter));
+}
+
+void eth_remove_filter(int filter)
+{
+	enc28j60_remove_rx_filter(eth_filter_to_enc28j60(filter));
+}
+
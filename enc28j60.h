@@ -7,119 +7,164 @@
 #define ENC28J60_H
 
 #include <stdint.h>
+#include "enc28j60io.h"
 
-uint32_t milliseconds();
-void enc28j60_init_io();
-void enc28j60_cs(int f);
-int enc28j60_io(int v);
+struct eth_checksum_t;
 
 void enc28j60_init(uint8_t const *macaddr);
-int enc28j60_peek_packet();
-void enc28j60_drop_packet();
-void enc28j60_recv_packet(uint8_t *ptr, int maxlen);
+int enc28j60_recv_begin(); // frame length, 0: no frame, -1: bad frame dropped
+int enc28j60_recv_read(uint8_t *ptr, int len); // continues where the previous read stopped
+void enc28j60_recv_end();
 void enc28j60_send_packet(uint8_t const *ptr, int len);
+void enc28j60_send_packet_csum(uint8_t const *ptr, int len, struct eth_checksum_t const *csum, int count);
+void enc28j60_add_rx_filter(int filter);
+void enc28j60_remove_rx_filter(int filter);
+
+struct enc28j60_stats_t {
+	uint32_t rx_frames; // frames handed to the caller
+	uint32_t rx_errors; // dropped for crc or length errors
+	uint32_t rx_checksum_errors; // dropped by checksum offload
+	uint32_t rx_overflows; // EIR.RXERIF events, one or more frames lost each
+	uint32_t rx_resets; // receive logic reset after a corrupted ring
+	uint8_t rx_pending_max; // highest EPKTCNT seen
+};
+
+void enc28j60_get_stats(struct enc28j60_stats_t *stats);
+void enc28j60_reset_stats();
+
+// receive filters (ERXFCON), unicast to our address with a valid CRC is always accepted
+#define ENC28J60_FILTER_BROADCAST 0x01 // BCEN
+#define ENC28J60_FILTER_MULTICAST 0x02 // MCEN
+#define ENC28J60_FILTER_ARP 0x10 // PMEN, broadcast ARP pattern
 
 #define MAX_FRAME_SIZE 1518
 
+#ifndef ENC28J60_RX_DMA
+#define ENC28J60_RX_DMA 1 // prefetch the next frame with DMA while the previous one is parsed
+#endif
+
+// buffer memory partition, receive ring at the bottom (errata: ERXST must be 0), transmit buffers above it
+#define BUFFER_MEMORY_SIZE 0x2000
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE 0x600 // control byte + frame + 7 bytes transmit status vector
+#endif
+#ifndef RX_BUFFER_SIZE
+#define RX_BUFFER_SIZE (BUFFER_MEMORY_SIZE - 2 * TX_BUFFER_SIZE)
+#endif
+
 #define RXST_INIT 0x0000
-#define TXST_INIT 0x1A00
+#define RXND_INIT (RXST_INIT + RX_BUFFER_SIZE - 1)
+#define TXST_INIT (RXND_INIT + 1) // two transmit buffers used alternately
+
+#if TX_BUFFER_SIZE < 1 + MAX_FRAME_SIZE + 7 || RX_BUFFER_SIZE < MAX_FRAME_SIZE + 6 || (RX_BUFFER_SIZE & 1) || TXST_INIT + 2 * TX_BUFFER_SIZE > BUFFER_MEMORY_SIZE
+#error "invalid ENC28J60 buffer partition"
+#endif
+
+// register address: bit 0-4 address, bit 5-6 bank, bit 7 MAC/MII register
+#define ADDR_MASK 0x1f
+#define BANK_MASK 0x60
+#define BANK0 0x00
+#define BANK1 0x20
+#define BANK2 0x40
+#define BANK3 0x60
+#define MREG 0x80 // reading a MAC/MII register returns a dummy byte first
 
 // bank 0
-#define ERDPTL 0x00
-#define ERDPTH 0x01
-#define EWRPTL 0x02
-#define EWRPTH 0x03
-#define ETXSTL 0x04
-#define ETXSTH 0x05
-#define ETXNDL 0x06
-#define ETXNDH 0x07
-#define ERXSTL 0x08
-#define ERXSTH 0x09
-#define ERXNDL 0x0a
-#define ERXNDH 0x0b
-#define ERXRDPTL 0x0c
-#define ERXRDPTH 0x0d
-#define ERXWRPTL 0x0e
-#define ERXWRPTH 0x0f
-#define EDMASTL 0x10
-#define EDMASTH 0x11
-#define EDMANDL 0x12
-#define EDMANDH 0x13
-#define EDMADSTL 0x14
-#define EDMADSTH 0x15
-#define EDMACSL 0x16
-#define EDMACSH 0x17
+#define ERDPTL (BANK0 | 0x00)
+#define ERDPTH (BANK0 | 0x01)
+#define EWRPTL (BANK0 | 0x02)
+#define EWRPTH (BANK0 | 0x03)
+#define ETXSTL (BANK0 | 0x04)
+#define ETXSTH (BANK0 | 0x05)
+#define ETXNDL (BANK0 | 0x06)
+#define ETXNDH (BANK0 | 0x07)
+#define ERXSTL (BANK0 | 0x08)
+#define ERXSTH (BANK0 | 0x09)
+#define ERXNDL (BANK0 | 0x0a)
+#define ERXNDH (BANK0 | 0x0b)
+#define ERXRDPTL (BANK0 | 0x0c)
+#define ERXRDPTH (BANK0 | 0x0d)
+#define ERXWRPTL (BANK0 | 0x0e)
+#define ERXWRPTH (BANK0 | 0x0f)
+#define EDMASTL (BANK0 | 0x10)
+#define EDMASTH (BANK0 | 0x11)
+#define EDMANDL (BANK0 | 0x12)
+#define EDMANDH (BANK0 | 0x13)
+#define EDMADSTL (BANK0 | 0x14)
+#define EDMADSTH (BANK0 | 0x15)
+#define EDMACSL (BANK0 | 0x16)
+#define EDMACSH (BANK0 | 0x17)
 //#define - 0x18
 //#define - 0x19
 
 // bank 1
-#define EHT0 0x00
-#define EHT1 0x01
-#define EHT2 0x02
-#define EHT3 0x03
-#define EHT4 0x04
-#define EHT5 0x05
-#define EHT6 0x06
-#define EHT7 0x07
-#define EPMM0 0x08
-#define EPMM1 0x09
-#define EPMM2 0x0a
-#define EPMM3 0x0b
-#define EPMM4 0x0c
-#define EPMM5 0x0d
-#define EPMM6 0x0e
-#define EPMM7 0x0f
-#define EPMCSL 0x10
-#define EPMCSH 0x11
+#define EHT0 (BANK1 | 0x00)
+#define EHT1 (BANK1 | 0x01)
+#define EHT2 (BANK1 | 0x02)
+#define EHT3 (BANK1 | 0x03)
+#define EHT4 (BANK1 | 0x04)
+#define EHT5 (BANK1 | 0x05)
+#define EHT6 (BANK1 | 0x06)
+#define EHT7 (BANK1 | 0x07)
+#define EPMM0 (BANK1 | 0x08)
+#define EPMM1 (BANK1 | 0x09)
+#define EPMM2 (BANK1 | 0x0a)
+#define EPMM3 (BANK1 | 0x0b)
+#define EPMM4 (BANK1 | 0x0c)
+#define EPMM5 (BANK1 | 0x0d)
+#define EPMM6 (BANK1 | 0x0e)
+#define EPMM7 (BANK1 | 0x0f)
+#define EPMCSL (BANK1 | 0x10)
+#define EPMCSH (BANK1 | 0x11)
 //#define - 0x12
 //#define - 0x13
-#define EPMOL 0x14
-#define EPMOH 0x15
+#define EPMOL (BANK1 | 0x14)
+#define EPMOH (BANK1 | 0x15)
 //#define Reserved 0x16
 //#define Reserved 0x17
-#define ERXFCON 0x18
-#define EPKTCNT 0x19
+#define ERXFCON (BANK1 | 0x18)
+#define EPKTCNT (BANK1 | 0x19)
 
 // bank 2
-#define MACON1 0x00
+#define MACON1 (BANK2 | MREG | 0x00)
 //#define Reserved 0x01
-#define MACON3 0x02
-#define MACON4 0x03
-#define MABBIPG 0x04
+#define MACON3 (BANK2 | MREG | 0x02)
+#define MACON4 (BANK2 | MREG | 0x03)
+#define MABBIPG (BANK2 | MREG | 0x04)
 //#define - 0x05
-#define MAIPGL 0x06
-#define MAIPGH 0x07
-#define MACLCON1 0x08
-#define MACLCON2 0x09
-#define MAMXFLL 0x0a
-#define MAMXFLH 0x0b
+#define MAIPGL (BANK2 | MREG | 0x06)
+#define MAIPGH (BANK2 | MREG | 0x07)
+#define MACLCON1 (BANK2 | MREG | 0x08)
+#define MACLCON2 (BANK2 | MREG | 0x09)
+#define MAMXFLL (BANK2 | MREG | 0x0a)
+#define MAMXFLH (BANK2 | MREG | 0x0b)
 //#define Reserved 0x0c
 //#define Reserved 0x0d
 //#define Reserved 0x0e
 //#define - 0x0f
 //#define Reserved 0x10
 //#define Reserved 0x11
-#define MICMD 0x12
+#define MICMD (BANK2 | MREG | 0x12)
 //#define - 0x13
-#define MIREGADR 0x14
+#define MIREGADR (BANK2 | MREG | 0x14)
 //#define Reserved 0x15
-#define MIWRL 0x16
-#define MIWRH 0x17
-#define MIRDL 0x18
-#define MIRDH 0x19
+#define MIWRL (BANK2 | MREG | 0x16)
+#define MIWRH (BANK2 | MREG | 0x17)
+#define MIRDL (BANK2 | MREG | 0x18)
+#define MIRDH (BANK2 | MREG | 0x19)
 
 // bank 3
-#define MAADR5 0x00
-#define MAADR6 0x01
-#define MAADR3 0x02
-#define MAADR4 0x03
-#define MAADR1 0x04
-#define MAADR2 0x05
-#define EBSTSD 0x06
-#define EBSTCON 0x07
-#define EBSTCSL 0x08
-#define EBSTCSH 0x09
-#define MISTAT 0x0a
+#define MAADR5 (BANK3 | MREG | 0x00)
+#define MAADR6 (BANK3 | MREG | 0x01)
+#define MAADR3 (BANK3 | MREG | 0x02)
+#define MAADR4 (BANK3 | MREG | 0x03)
+#define MAADR1 (BANK3 | MREG | 0x04)
+#define MAADR2 (BANK3 | MREG | 0x05)
+#define EBSTSD (BANK3 | 0x06)
+#define EBSTCON (BANK3 | 0x07)
+#define EBSTCSL (BANK3 | 0x08)
+#define EBSTCSH (BANK3 | 0x09)
+#define MISTAT (BANK3 | MREG | 0x0a)
 //#define - 0x0b
 //#define - 0x0c
 //#define - 0x0d
@@ -127,16 +172,16 @@ void enc28j60_send_packet(uint8_t const *ptr, int len);
 //#define - 0x0f
 //#define - 0x10
 //#define - 0x11
-#define EREVID 0x12
+#define EREVID (BANK3 | 0x12)
 //#define - 0x13
 //#define - 0x14
-#define ECOCON 0x15
+#define ECOCON (BANK3 | 0x15)
 //#define Reserved 0x16
-#define EFLOCON 0x17
-#define EPAUSL 0x18
-#define EPAUSH 0x19
+#define EFLOCON (BANK3 | 0x17)
+#define EPAUSL (BANK3 | 0x18)
+#define EPAUSH (BANK3 | 0x19)
 
-// common
+// common (available in every bank)
 //#define Reserved 0x1a
 #define EIE 0x1b
 #define EIR 0x1c
@@ -5,21 +5,153 @@
 
 #include "enc28j60io.h"
 #include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "pico/rand.h"
+#if ENC28J60_PIO_SPI
+#include "hardware/pio.h"
+#include "hardware/clocks.h"
+#include "enc28j60_spi.pio.h"
+#else
 #include "hardware/spi.h"
+#endif
 
 #define PIN_SCK  2
 #define PIN_MOSI 3
 #define PIN_MISO 4
 #define PIN_CS   5
+#ifdef ENC28J60_PIN_INT
+#define PIN_INT  ENC28J60_PIN_INT // active low, optional
+#endif
 
+#if ENC28J60_PIO_SPI
+#define SPI_PIO pio0
+#define SPI_HZ (20 * 1000 * 1000) // ENC28J60 maximum
+#else
 #define SPI_PORT spi0
+#endif
+
+static struct enc28j60_io_stats_t _enc28j60_io_stats;
+static int _enc28j60_dma_tx = -1;
+static int _enc28j60_dma_rx = -1;
+static uint8_t const _enc28j60_dma_zero = 0;
+static volatile bool _enc28j60_irq_pending = true;
+static volatile uint64_t _enc28j60_irq_time;
+#if ENC28J60_PIO_SPI
+static uint _enc28j60_sm;
+#endif
 
 uint32_t milliseconds()
 {
 	return to_ms_since_boot(get_absolute_time());
 }
 
-void enc28j60_init_io()
+uint32_t random32()
+{
+	return get_rand_32();
+}
+
+#ifdef PIN_INT
+static void enc28j60_irq_handler(uint gpio, uint32_t events)
+{
+	_enc28j60_irq_time = time_us_64();
+	_enc28j60_irq_pending = true;
+}
+#endif
+
+#if ENC28J60_PIO_SPI
+
+// the state machine asserts CS, clocks the given number of bits and releases CS
+static void enc28j60_spi_init()
+{
+	uint32_t pins = (1u << PIN_CS) | (1u << PIN_SCK) | (1u << PIN_MOSI);
+	uint offset = pio_add_program(SPI_PIO, &enc28j60_spi_program);
+	pio_sm_config c = enc28j60_spi_program_get_default_config(offset);
+
+	_enc28j60_sm = pio_claim_unused_sm(SPI_PIO, true);
+
+	sm_config_set_out_pins(&c, PIN_MOSI, 1);
+	sm_config_set_in_pins(&c, PIN_MISO);
+	sm_config_set_set_pins(&c, PIN_CS, 1);
+	sm_config_set_sideset_pins(&c, PIN_SCK);
+	sm_config_set_out_shift(&c, false, true, 8); // msb first, autopull
+	sm_config_set_in_shift(&c, false, true, 8); // msb first, autopush
+	sm_config_set_clkdiv(&c, (float)clock_get_hz(clk_sys) / (4.0f * SPI_HZ)); // 4 cycles per bit
+
+	pio_sm_set_pins_with_mask(SPI_PIO, _enc28j60_sm, 1u << PIN_CS, pins);
+	pio_sm_set_pindirs_with_mask(SPI_PIO, _enc28j60_sm, pins, pins | (1u << PIN_MISO));
+	pio_gpio_init(SPI_PIO, PIN_CS);
+	pio_gpio_init(SPI_PIO, PIN_SCK);
+	pio_gpio_init(SPI_PIO, PIN_MOSI);
+	pio_gpio_init(SPI_PIO, PIN_MISO);
+
+	pio_sm_init(SPI_PIO, _enc28j60_sm, offset, &c);
+	pio_sm_set_enabled(SPI_PIO, _enc28j60_sm, true);
+}
+
+static void enc28j60_spi_begin(uint8_t op, int n)
+{
+	io_rw_8 *txfifo = (io_rw_8 *)&SPI_PIO->txf[_enc28j60_sm];
+	pio_sm_put_blocking(SPI_PIO, _enc28j60_sm, (1 + n) * 8 - 1); // bit count - 1
+	while (pio_sm_is_tx_fifo_full(SPI_PIO, _enc28j60_sm));
+	*txfifo = op; // byte writes are replicated to the msb lane
+}
+
+static void enc28j60_spi_transfer(uint8_t op, uint8_t const *tx, uint8_t *rx, int n)
+{
+	io_rw_8 *txfifo = (io_rw_8 *)&SPI_PIO->txf[_enc28j60_sm];
+	io_rw_8 *rxfifo = (io_rw_8 *)&SPI_PIO->rxf[_enc28j60_sm];
+	int tx_remain = n;
+	int rx_remain = n + 1; // the byte clocked in with the opcode is dropped
+
+	enc28j60_spi_begin(op, n);
+	while (tx_remain > 0 || rx_remain > 0) {
+		if (tx_remain > 0 && !pio_sm_is_tx_fifo_full(SPI_PIO, _enc28j60_sm)) {
+			*txfifo = tx ? *tx++ : 0;
+			tx_remain--;
+		}
+		if (rx_remain > 0 && !pio_sm_is_rx_fifo_empty(SPI_PIO, _enc28j60_sm)) {
+			uint8_t c = *rxfifo;
+			if (rx && rx_remain <= n) {
+				*rx++ = c;
+			}
+			rx_remain--;
+		}
+	}
+}
+
+static void enc28j60_spi_transfer_start(uint8_t op, uint8_t *rx, int n)
+{
+	dma_channel_config c;
+
+	enc28j60_spi_begin(op, n);
+	while (pio_sm_is_rx_fifo_empty(SPI_PIO, _enc28j60_sm));
+	(void)*(io_rw_8 *)&SPI_PIO->rxf[_enc28j60_sm];
+
+	c = dma_channel_get_default_config(_enc28j60_dma_tx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(SPI_PIO, _enc28j60_sm, true));
+	dma_channel_configure(_enc28j60_dma_tx, &c, &SPI_PIO->txf[_enc28j60_sm], &_enc28j60_dma_zero, n, false);
+
+	c = dma_channel_get_default_config(_enc28j60_dma_rx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_dreq(&c, pio_get_dreq(SPI_PIO, _enc28j60_sm, false));
+	dma_channel_configure(_enc28j60_dma_rx, &c, rx, &SPI_PIO->rxf[_enc28j60_sm], n, false);
+
+	dma_start_channel_mask((1u << _enc28j60_dma_tx) | (1u << _enc28j60_dma_rx));
+}
+
+static void enc28j60_spi_transfer_end()
+{
+	// the state machine releases CS by itself
+}
+
+#else
+
+static void enc28j60_spi_init()
 {
 	spi_init(SPI_PORT, 50 * 1000 * 1000);
 	spi_set_format(SPI_PORT, 8, SPI_CPOL_0, SPI_CPHA_1, SPI_MSB_FIRST);
@@ -31,16 +163,137 @@ void enc28j60_init_io()
 	gpio_put(PIN_CS, 1);
 }
 
-void enc28j60_cs(bool f)
+static void enc28j60_cs(bool f)
 {
 	gpio_put(PIN_CS, f);  // Active low
 	sleep_us(1);
 }
 
-int enc28j60_io(uint8_t c)
+static void enc28j60_spi_transfer(uint8_t op, uint8_t const *tx, uint8_t *rx, int n)
+{
+	enc28j60_cs(0);
+	spi_write_blocking(SPI_PORT, &op, 1);
+	if (n > 0) {
+		if (!tx) {
+			spi_read_blocking(SPI_PORT, 0, rx, n);
+		} else if (!rx) {
+			spi_write_blocking(SPI_PORT, tx, n);
+		} else {
+			spi_write_read_blocking(SPI_PORT, tx, rx, n);
+		}
+	}
+	enc28j60_cs(1);
+}
+
+static void enc28j60_spi_transfer_start(uint8_t op, uint8_t *rx, int n)
+{
+	dma_channel_config c;
+
+	enc28j60_cs(0);
+	spi_write_blocking(SPI_PORT, &op, 1);
+
+	// tx: clock out zeros, rx: drain the fifo into the buffer
+	c = dma_channel_get_default_config(_enc28j60_dma_tx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, spi_get_dreq(SPI_PORT, true));
+	dma_channel_configure(_enc28j60_dma_tx, &c, &spi_get_hw(SPI_PORT)->dr, &_enc28j60_dma_zero, n, false);
+
+	c = dma_channel_get_default_config(_enc28j60_dma_rx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_dreq(&c, spi_get_dreq(SPI_PORT, false));
+	dma_channel_configure(_enc28j60_dma_rx, &c, rx, &spi_get_hw(SPI_PORT)->dr, n, false);
+
+	dma_start_channel_mask((1u << _enc28j60_dma_tx) | (1u << _enc28j60_dma_rx));
+}
+
+static void enc28j60_spi_transfer_end()
+{
+	enc28j60_cs(1);
+}
+
+#endif
+
+void enc28j60_init_io()
+{
+	enc28j60_spi_init();
+
+	_enc28j60_dma_tx = dma_claim_unused_channel(true);
+	_enc28j60_dma_rx = dma_claim_unused_channel(true);
+
+#ifdef PIN_INT
+	gpio_init(PIN_INT);
+	gpio_set_dir(PIN_INT, GPIO_IN);
+	gpio_pull_up(PIN_INT);
+	gpio_set_irq_enabled_with_callback(PIN_INT, GPIO_IRQ_EDGE_FALL, true, enc28j60_irq_handler);
+#endif
+}
+
+void enc28j60_transfer(uint8_t op, uint8_t const *tx, uint8_t *rx, int n)
+{
+	_enc28j60_io_stats.transactions++;
+	_enc28j60_io_stats.bytes += 1 + n;
+	enc28j60_spi_transfer(op, tx, rx, n);
+}
+
+void enc28j60_transfer_start(uint8_t op, uint8_t *rx, int n)
+{
+	_enc28j60_io_stats.transactions++;
+	_enc28j60_io_stats.bytes += 1 + n;
+	enc28j60_spi_transfer_start(op, rx, n);
+}
+
+bool enc28j60_transfer_busy()
 {
-	spi_write_read_blocking(SPI_PORT, &c, &c, 1);
-	return c;
+	return dma_channel_is_busy(_enc28j60_dma_rx);
 }
 
+void enc28j60_transfer_wait()
+{
+	dma_channel_wait_for_finish_blocking(_enc28j60_dma_rx);
+	enc28j60_spi_transfer_end();
+}
+
+bool enc28j60_irq_enabled()
+{
+#ifdef PIN_INT
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool enc28j60_irq_pending()
+{
+#ifdef PIN_INT
+	// INT stays low while EPKTCNT != 0, so the level covers edges lost to a clear
+	return _enc28j60_irq_pending || !gpio_get(PIN_INT);
+#else
+	return true; // not wired, the caller has to poll
+#endif
+}
+
+void enc28j60_irq_clear()
+{
+	_enc28j60_irq_pending = false;
+}
+
+uint64_t enc28j60_irq_time()
+{
+	return _enc28j60_irq_time;
+}
+
+void enc28j60_io_get_stats(struct enc28j60_io_stats_t *stats)
+{
+	*stats = _enc28j60_io_stats;
+}
+
+void enc28j60_io_reset_stats()
+{
+	_enc28j60_io_stats.transactions = 0;
+	_enc28j60_io_stats.bytes = 0;
+}
 
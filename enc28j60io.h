@@ -13,9 +13,23 @@
 extern "C" {
 #endif
 
+struct enc28j60_io_stats_t {
+	uint32_t transactions; // chip select assertions
+	uint32_t bytes;
+};
+
 uint32_t milliseconds();
-void enc28j60_cs(bool f);
-int enc28j60_io(uint8_t c);
+void enc28j60_init_io();
+void enc28j60_transfer(uint8_t op, uint8_t const *tx, uint8_t *rx, int n); // op + n bytes in one chip select, tx == 0: send zeros, rx == 0: discard
+void enc28j60_transfer_start(uint8_t op, uint8_t *rx, int n); // receive with DMA
+bool enc28j60_transfer_busy();
+void enc28j60_transfer_wait(); // ends the transaction begun by enc28j60_transfer_start
+bool enc28j60_irq_enabled(); // INT line wired
+bool enc28j60_irq_pending();
+void enc28j60_irq_clear();
+uint64_t enc28j60_irq_time(); // microseconds since boot of the last INT assertion
+void enc28j60_io_get_stats(struct enc28j60_io_stats_t *stats);
+void enc28j60_io_reset_stats();
 
 #ifdef __cplusplus
 }
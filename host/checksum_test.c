@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) 2021 S.Fuchita (@soramimi_jp)
+ * MIT License
+ */
+
+// compute_sum() against the byte at a time sum it replaced, at every alignment
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+uint16_t compute_sum(uint16_t sum, void const *ptr, int len); // ip.c
+
+static uint16_t bytewise_sum(uint16_t sum, void const *ptr, int len)
+{
+	int i;
+	uint32_t s = sum;
+	for (i = 0; i < len; i++) {
+		uint16_t c = ((uint8_t const *)ptr)[i];
+		if (i & 1) {
+			s += c;
+		} else {
+			s += c << 8;
+		}
+		s = (s + (s >> 16)) & 0xffff;
+	}
+	return (uint16_t)s;
+}
+
+static uint8_t buf[8 + 200000];
+
+int main()
+{
+	int bad = 0;
+	int t;
+	int i;
+	clock_t c;
+	double a;
+	double b;
+	volatile uint16_t r = 0;
+
+	srand(1);
+	for (t = 0; t < 200000; t++) {
+		int off = rand() % 8;
+		int len = rand() % (t % 1000 == 0 ? 200000 : 1600); // now and then past the 64K fold
+		int fill = rand() % 4;
+		uint16_t sum = rand() % 3 == 0 ? 0 : rand() % 2 == 0 ? 0xffff : rand() & 0xffff;
+		for (i = 0; i < len; i++) {
+			buf[off + i] = fill == 0 ? 0x00 : fill == 1 ? 0xff : rand();
+		}
+		if (compute_sum(sum, buf + off, len) != bytewise_sum(sum, buf + off, len)) {
+			if (bad++ < 10) {
+				printf("mismatch: offset %d length %d sum %04x\n", off, len, sum);
+			}
+		}
+	}
+	printf("%d mismatches\n", bad);
+
+	for (i = 0; i < 1500; i++) {
+		buf[i] = rand();
+	}
+	c = clock();
+	for (t = 0; t < 200000; t++) {
+		r += bytewise_sum(0, buf + (t & 1), 1472);
+	}
+	a = clock() - c;
+	c = clock();
+	for (t = 0; t < 200000; t++) {
+		r += compute_sum(0, buf + (t & 1), 1472);
+	}
+	b = clock() - c;
+	printf("1472 bytes: byte-wise %.0f ns, compute_sum %.0f ns (%.1fx)\n", a / CLOCKS_PER_SEC * 1e9 / 200000, b / CLOCKS_PER_SEC * 1e9 / 200000, a / b);
+
+	return bad != 0;
+}
@@ -0,0 +1,262 @@
+/**
+ * Copyright (C) 2021 S.Fuchita (@soramimi_jp)
+ * MIT License
+ */
+
+#include "enc28j60io_host.h"
+#include "enc28j60.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static struct enc28j60_io_stats_t _enc28j60_io_stats;
+static uint8_t _host_regs[4][0x20]; // 0x1b-0x1f live in bank 0 and are shared
+static uint8_t _host_mem[BUFFER_MEMORY_SIZE];
+static uint16_t _host_rx_wr; // where the next received frame goes
+static uint8_t _host_tx[MAX_FRAME_SIZE];
+static int _host_tx_len;
+
+static uint8_t *host_reg(int addr)
+{
+	if (addr >= (EIE & ADDR_MASK)) {
+		return &_host_regs[0][addr];
+	}
+	return &_host_regs[_host_regs[0][ECON1 & ADDR_MASK] & 0x03][addr];
+}
+
+static uint16_t host_reg16(int reg)
+{
+	return _host_regs[(reg & BANK_MASK) >> 5][reg & ADDR_MASK] | (_host_regs[(reg & BANK_MASK) >> 5][(reg & ADDR_MASK) + 1] << 8);
+}
+
+static void host_set_reg16(int reg, uint16_t v)
+{
+	_host_regs[(reg & BANK_MASK) >> 5][reg & ADDR_MASK] = v & 0xff;
+	_host_regs[(reg & BANK_MASK) >> 5][(reg & ADDR_MASK) + 1] = v >> 8;
+}
+
+// the read pointer wraps inside the receive ring, the write pointer does not
+static uint16_t host_next_read(uint16_t p)
+{
+	if (p == host_reg16(ERXNDL)) {
+		return host_reg16(ERXSTL);
+	}
+	return (p + 1) & (BUFFER_MEMORY_SIZE - 1);
+}
+
+static void host_reset()
+{
+	memset(_host_regs, 0, sizeof(_host_regs));
+	_host_regs[0][ESTAT & ADDR_MASK] = 0x01; // CLKRDY
+	_host_rx_wr = RXST_INIT;
+}
+
+// self clearing bits act at once
+static void host_control_written(int addr)
+{
+	uint8_t *econ1 = &_host_regs[0][ECON1 & ADDR_MASK];
+	uint8_t *econ2 = &_host_regs[0][ECON2 & ADDR_MASK];
+	if (addr == (ECON1 & ADDR_MASK)) {
+		if (*econ1 & 0x20) { // DMAST
+			if (*econ1 & 0x10) { // CSUMEN
+				uint32_t sum = 0;
+				uint16_t p = host_reg16(EDMASTL);
+				uint16_t end = host_reg16(EDMANDL);
+				int i = 0;
+				while (1) {
+					sum += (i & 1) ? _host_mem[p] : _host_mem[p] << 8;
+					i++;
+					if (p == end) {
+						break;
+					}
+					p = host_next_read(p);
+				}
+				while (sum >> 16) {
+					sum = (sum & 0xffff) + (sum >> 16);
+				}
+				sum = ~sum & 0xffff;
+				_host_regs[0][EDMACSL & ADDR_MASK] = sum & 0xff;
+				_host_regs[0][EDMACSH & ADDR_MASK] = sum >> 8;
+			}
+			*econ1 &= ~0x20;
+		}
+		if (*econ1 & 0x08) { // TXRTS
+			uint16_t st = host_reg16(ETXSTL);
+			uint16_t nd = host_reg16(ETXNDL);
+			_host_tx_len = nd - st; // behind the per packet control byte
+			if (_host_tx_len > MAX_FRAME_SIZE) {
+				_host_tx_len = MAX_FRAME_SIZE;
+			}
+			memcpy(_host_tx, _host_mem + st + 1, _host_tx_len);
+			*econ1 &= ~0x08;
+		}
+	}
+	if (addr == (ECON2 & ADDR_MASK) && (*econ2 & 0x40)) { // PKTDEC
+		if (_host_regs[1][EPKTCNT & ADDR_MASK] > 0) {
+			_host_regs[1][EPKTCNT & ADDR_MASK]--;
+		}
+		*econ2 &= ~0x40;
+	}
+}
+
+static void host_transfer(uint8_t op, uint8_t const *tx, uint8_t *rx, int n)
+{
+	int addr = op & ADDR_MASK;
+	int i;
+	uint16_t p;
+
+	switch (op >> 5) {
+	case 0: // read control register
+		for (i = 0; i < n; i++) {
+			if (rx) {
+				rx[i] = *host_reg(addr);
+			}
+		}
+		break;
+	case 1: // read buffer memory
+		p = host_reg16(ERDPTL);
+		for (i = 0; i < n; i++) {
+			if (rx) {
+				rx[i] = _host_mem[p];
+			}
+			p = host_next_read(p);
+		}
+		host_set_reg16(ERDPTL, p);
+		break;
+	case 2: // write control register
+		*host_reg(addr) = tx ? tx[0] : 0;
+		host_control_written(addr);
+		break;
+	case 3: // write buffer memory
+		p = host_reg16(EWRPTL);
+		for (i = 0; i < n; i++) {
+			_host_mem[p] = tx ? tx[i] : 0;
+			p = (p + 1) & (BUFFER_MEMORY_SIZE - 1);
+		}
+		host_set_reg16(EWRPTL, p);
+		break;
+	case 4: // bit field set
+		*host_reg(addr) |= tx ? tx[0] : 0;
+		host_control_written(addr);
+		break;
+	case 5: // bit field clear
+		*host_reg(addr) &= ~(tx ? tx[0] : 0);
+		break;
+	case 7: // system reset
+		host_reset();
+		break;
+	}
+}
+
+void enc28j60_host_receive(uint8_t const *frame, int len)
+{
+	uint16_t start = host_reg16(ERXSTL);
+	uint16_t end = host_reg16(ERXNDL);
+	uint16_t size = end - start + 1;
+	uint16_t next = _host_rx_wr + ((6 + len + 4 + 1) & ~1);
+	uint16_t used = (_host_rx_wr + size - host_reg16(ERXRDPTL) - 1) % size; // ERXRDPT trails the last free byte
+	uint8_t hdr[6];
+	int i;
+
+	if (used + (next - _host_rx_wr) >= size) {
+		_host_regs[0][EIR & ADDR_MASK] |= 0x01; // RXERIF, the frame is lost
+		return;
+	}
+	if (next > end) {
+		next -= size;
+	}
+	hdr[0] = next & 0xff;
+	hdr[1] = next >> 8;
+	hdr[2] = (len + 4) & 0xff; // with the crc
+	hdr[3] = (len + 4) >> 8;
+	hdr[4] = 0x80; // received ok
+	hdr[5] = 0x00;
+	for (i = 0; i < 6 + len + 4; i++) {
+		_host_mem[_host_rx_wr] = i < 6 ? hdr[i] : i < 6 + len ? frame[i - 6] : 0;
+		_host_rx_wr = _host_rx_wr == end ? start : _host_rx_wr + 1;
+	}
+	_host_rx_wr = next;
+	_host_regs[1][EPKTCNT & ADDR_MASK]++;
+	_host_regs[0][EIR & ADDR_MASK] |= 0x40; // PKTIF
+}
+
+int enc28j60_host_sent(uint8_t *ptr, int maxlen)
+{
+	int len = _host_tx_len < maxlen ? _host_tx_len : maxlen;
+	memcpy(ptr, _host_tx, len);
+	return _host_tx_len;
+}
+
+uint32_t milliseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void sleep_ms(uint32_t ms)
+{
+}
+
+uint32_t random32()
+{
+	return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+void enc28j60_init_io()
+{
+	host_reset();
+}
+
+void enc28j60_transfer(uint8_t op, uint8_t const *tx, uint8_t *rx, int n)
+{
+	_enc28j60_io_stats.transactions++;
+	_enc28j60_io_stats.bytes += 1 + n;
+	host_transfer(op, tx, rx, n);
+}
+
+void enc28j60_transfer_start(uint8_t op, uint8_t *rx, int n)
+{
+	_enc28j60_io_stats.transactions++;
+	_enc28j60_io_stats.bytes += 1 + n;
+	host_transfer(op, 0, rx, n); // done at once, there is no DMA to wait for
+}
+
+bool enc28j60_transfer_busy()
+{
+	return false;
+}
+
+void enc28j60_transfer_wait()
+{
+}
+
+bool enc28j60_irq_enabled()
+{
+	return false;
+}
+
+bool enc28j60_irq_pending()
+{
+	return true; // poll EPKTCNT like a board without INT
+}
+
+void enc28j60_irq_clear()
+{
+}
+
+uint64_t enc28j60_irq_time()
+{
+	return 0;
+}
+
+void enc28j60_io_get_stats(struct enc28j60_io_stats_t *stats)
+{
+	*stats = _enc28j60_io_stats;
+}
+
+void enc28j60_io_reset_stats()
+{
+	_enc28j60_io_stats.transactions = 0;
+	_enc28j60_io_stats.bytes = 0;
+}
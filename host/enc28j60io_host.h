@@ -0,0 +1,16 @@
+/**
+ * Copyright (C) 2021 S.Fuchita (@soramimi_jp)
+ * MIT License
+ */
+
+#ifndef ENC28J60IO_HOST_H
+#define ENC28J60IO_HOST_H
+
+#include "enc28j60io.h"
+
+// host stand-in of the ENC28J60 behind enc28j60io.h: registers, buffer memory, receive ring, DMA checksum
+
+void enc28j60_host_receive(uint8_t const *frame, int len); // as if the frame arrived from the wire
+int enc28j60_host_sent(uint8_t *ptr, int maxlen); // length of the last transmitted frame, 0: none
+
+#endif
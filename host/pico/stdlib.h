@@ -0,0 +1,16 @@
+/**
+ * Copyright (C) 2021 S.Fuchita (@soramimi_jp)
+ * MIT License
+ */
+
+// the part of the Pico SDK the driver uses, for host builds
+
+#ifndef PICO_STDLIB_H
+#define PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void sleep_ms(uint32_t ms);
+
+#endif
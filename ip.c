@@ -5,7 +5,10 @@
 
 #include "ip.h"
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
 #define MAX_FRAME_SIZE 1518
@@ -109,26 +112,97 @@ struct dns_frame_t {
 } __attribute__ ((packed));
 
 enum {
-	STATE_IDLE,
-	STATE_SENT_DHCP_DISCOVER,
-	STATE_DHCP_NACK,
+	DHCP_OFF, // static configuration
+	DHCP_SELECTING, // discover sent
+	DHCP_REQUESTING, // request for an offer sent
+	DHCP_BOUND,
+	DHCP_RENEWING, // t1 passed, asking the server of the lease
+	DHCP_REBINDING, // t2 passed, asking any server
 };
 
-#define ARP_CACHE_SIZE 10
-#define DNS_CACHE_SIZE 10
+#define DHCP_RETRY_INTERVAL 2000 // ms, doubled on every retry
+#define DHCP_RETRY_INTERVAL_MAX 32000
+#define DHCP_REQUEST_RETRY 4 // requests for an offer before starting over
+#define DHCP_RENEW_INTERVAL_MIN 60 // seconds
+#define DHCP_BOOT_TIMEOUT 30000 // ms, ip_config_with_dhcp()
+
+struct dhcp_client_t {
+	int state;
+	uint32_t xid;
+	uint32_t tick; // milliseconds() of the last transmission
+	uint32_t interval; // ms until the next one
+	int retry;
+	uint32_t lease_start; // uptime seconds
+	uint32_t lease_time; // seconds, 0xffffffff: infinite
+	uint32_t t1;
+	uint32_t t2;
+	uint8_t server_id[4];
+	uint8_t offered_addr[4];
+};
+
+#define ARP_CACHE_SIZE 8
+#define ARP_CACHE_TIMEOUT 600 // seconds without confirmation
+#define ARP_REFRESH_AGE 540 // an entry in use is asked for again from this age on
+#define DNS_CACHE_SIZE 8
+#define DNS_CACHE_ADDRS 4 // A records kept per name
+#define DNS_TTL_MAX (24 * 60 * 60)
+#define DNS_QUERY_COUNT 4 // queries in flight
+#define DNS_NAME_SIZE 64
+#define DNS_RETRY_INTERVAL 5000 // ms
+#define DNS_RETRY_COUNT 12
 #define UDP_PACKET_BUFFER_SIZE 8
+#ifndef UDP_PACKET_DATA_SIZE
+#define UDP_PACKET_DATA_SIZE 548 // 576 byte datagram, larger ones are dropped
+#endif
+#define UDP_PACKET_SLOT_SIZE (sizeof(struct packet_header_t) + UDP_PACKET_DATA_SIZE)
+#define UDP_BINDING_COUNT 8
+#define DHCP_CLIENT_PORT 68
+#define DNS_CLIENT_PORT 49153
+#define FRAME_POOL_SIZE 5 // receive + icmp reply + caller's frame + ARP_PENDING_SIZE
+#define ARP_PENDING_SIZE 2
+#define ARP_RETRY_INTERVAL 1000 // ms
+#define ARP_RETRY_COUNT 5
 
 struct arp_cache_item_t {
-	bool valid;
+	bool valid; // false: never used
 	uint8_t ipv4[4];
 	uint8_t mac[6];
+	uint32_t updated; // uptime seconds of the last confirmation
+	uint32_t requested; // uptime seconds of the last refresh request
 };
 
 struct dns_cache_item_t {
+	uint32_t hash; // 0: never used
+	uint32_t expires; // uptime seconds
+	uint8_t count; // addresses, 0: negative or expired
+	uint8_t next; // rotation
+	uint8_t ipv4[DNS_CACHE_ADDRS][4];
+	char name[DNS_NAME_SIZE];
+};
+
+struct udp_binding_t {
+	uint16_t port; // 0: free
+	udp_handler_t handler; // 0: queue for borrow_udp_packet()
+	void *ctx;
+};
+
+struct arp_pending_item_t {
+	uint8_t *frame; // pool frame waiting for the destination mac address, 0: free
+	uint16_t length;
+	uint8_t ipv4[4]; // next hop being resolved
+	uint32_t tick; // last request
+	uint8_t retry;
+};
+
+struct dns_query_t {
+	int status; // DNS_FREE, DNS_PENDING, DNS_RESOLVED, DNS_FAILED
 	uint16_t transaction_id;
-	bool valid_address;
+	uint8_t retry;
+	uint32_t tick; // last sent
+	dns_handler_t handler;
+	void *ctx;
 	uint8_t ipv4[4];
-	char name[1];
+	char name[DNS_NAME_SIZE];
 };
 
 struct ip_stack_globals_t {
@@ -141,35 +215,83 @@ struct ip_stack_globals_t {
 	uint16_t ip_identifier;
 	uint16_t dns_transaction_id;
 	struct arp_cache_item_t arp_cache[ARP_CACHE_SIZE];
-	struct dns_cache_item_t *dns_cache[DNS_CACHE_SIZE];
-	struct packet_header_t *udp_packets[UDP_PACKET_BUFFER_SIZE];
+	struct arp_pending_item_t arp_pending[ARP_PENDING_SIZE];
+	void (*send_error_handler)(uint8_t const *dstipv4);
+	struct dns_cache_item_t dns_cache[DNS_CACHE_SIZE]; // open addressing by name hash
+	uint32_t uptime_seconds;
+	uint32_t uptime_ms; // milliseconds() at uptime_seconds
+	struct dns_query_t dns_queries[DNS_QUERY_COUNT];
+	uint8_t udp_packets[UDP_PACKET_BUFFER_SIZE][UDP_PACKET_SLOT_SIZE] __attribute__ ((aligned(4))); // ring
+	uint16_t udp_packet_head; // oldest packet
 	uint16_t udp_packet_count;
-	int dhcp_ack_waiting;
-	int state;
+	struct udp_binding_t udp_bindings[UDP_BINDING_COUNT];
+	struct dhcp_client_t dhcp;
+	uint8_t frame_pool[FRAME_POOL_SIZE][MAX_FRAME_SIZE];
+	uint8_t frame_pool_used; // bit mask
+	struct ip_stack_stats_t stats;
 } ip_stack_globals;
 
 
+static void on_dhcp_packet(void *ctx, uint8_t const *srcipv4, uint16_t srcport, uint16_t dstport, uint8_t const *data, uint16_t len);
+static void on_dns_packet(void *ctx, uint8_t const *srcipv4, uint16_t srcport, uint16_t dstport, uint8_t const *data, uint16_t len);
+static void process_dhcp();
+static void process_arp_pending(uint8_t const *resolved);
+static void arp_cache_update(uint8_t const *ipv4, uint8_t const *mac, bool create);
+static void arp_cache_refresh(uint8_t const *ipv4, uint8_t const *mac);
+static void process_dns_queries();
+static void finish_dns_query(struct dns_query_t *q, uint8_t const *ipv4);
+static void dns_cache_add(char const *name, uint8_t const (*ipv4)[4], int count, uint32_t ttl);
+int send_ip_packet(uint8_t *packet, int length);
+
 void ip_stack_init(uint8_t const *macaddr)
 {
-	int i;
 	memset(&ip_stack_globals, 0, sizeof(ip_stack_globals));
 	memcpy(ip_stack_globals.mac_addr, macaddr, 6);
 	ip_stack_globals.packet_id = 0;
-	ip_stack_globals.state = STATE_IDLE;
-	ip_stack_globals.dhcp_ack_waiting = 0;
+	ip_stack_globals.dhcp.state = DHCP_OFF;
 	ip_stack_globals.ip_identifier = 0;
-	ip_stack_globals.dns_transaction_id = 0;
-	for (i = 0; i < DNS_CACHE_SIZE; i++) {
-		ip_stack_globals.dns_cache[i] = 0;
-	}
-	for (i = 0; i < UDP_PACKET_BUFFER_SIZE; i++) {
-		ip_stack_globals.udp_packets[i] = 0;
-	}
+	ip_stack_globals.dns_transaction_id = random32(); // not the same ids after every boot
+	ip_stack_globals.uptime_ms = milliseconds();
+	ip_stack_globals.udp_packet_head = 0;
 	ip_stack_globals.udp_packet_count = 0;
+	udp_bind(DHCP_CLIENT_PORT, on_dhcp_packet, 0);
+	udp_bind(DNS_CLIENT_PORT, on_dns_packet, 0);
 	eth_init(ip_stack_globals.mac_addr);
 	sleep_ms(100);
 }
 
+// frame buffers, borrowed instead of putting 1.5 KB on the stack
+
+static uint8_t *borrow_frame()
+{
+	int i, n;
+	for (i = 0; i < FRAME_POOL_SIZE; i++) {
+		if (!(ip_stack_globals.frame_pool_used & (1 << i))) {
+			ip_stack_globals.frame_pool_used |= 1 << i;
+			n = __builtin_popcount(ip_stack_globals.frame_pool_used);
+			if (n > ip_stack_globals.stats.frames_in_use_max) {
+				ip_stack_globals.stats.frames_in_use_max = n;
+			}
+			return ip_stack_globals.frame_pool[i];
+		}
+	}
+	ip_stack_globals.stats.frame_pool_exhausted++;
+	return 0;
+}
+
+static void return_frame(uint8_t *frame)
+{
+	int i = (frame - ip_stack_globals.frame_pool[0]) / MAX_FRAME_SIZE;
+	if (i >= 0 && i < FRAME_POOL_SIZE && frame == ip_stack_globals.frame_pool[i]) {
+		ip_stack_globals.frame_pool_used &= ~(1 << i);
+	}
+}
+
+void ip_stack_get_stats(struct ip_stack_stats_t *stats)
+{
+	*stats = ip_stack_globals.stats;
+}
+
 //
 
 uint32_t get_ip_address()
@@ -213,19 +335,50 @@ uint16_t read_s(uint16_t const *ptr)
 	return (p[0] << 8) | p[1];
 }
 
+typedef uint16_t __attribute__((may_alias)) uint16_alias_t;
+
+// ones' complement sum of big endian halfwords, added to sum.
+// memory is summed as aligned little endian halfwords (like ntohs(), a little endian host is assumed)
+// and the carries are folded once per 64K bytes; the result is byte swapped back when the data
+// started on an even address.
 uint16_t compute_sum(uint16_t sum, void const *ptr, int len)
 {
-	int i;
-	uint32_t s = sum;
-	for (i = 0; i < len; i++) {
-		uint16_t c = ((uint8_t const *)ptr)[i];
-		if (i & 1) {
-			s += c;
-		} else {
-			s += c << 8;
+	uint8_t const *p = (uint8_t const *)ptr;
+	bool swap = !((uintptr_t)p & 1);
+	uint32_t s = 0;
+	if (len <= 0) {
+		return sum;
+	}
+	if (!swap) {
+		s = *p++ << 8; // odd address, high byte of the little endian halfword
+		len--;
+	}
+	while (len >= 2) {
+		uint16_alias_t const *q = (uint16_alias_t const *)p;
+		int n = len < 0x10000 ? len >> 1 : 0x8000; // 0x8000 * 0xffff + 0xffff fits 32 bits
+		p += n * 2;
+		len -= n * 2;
+		while (n >= 4) {
+			s += q[0] + q[1] + q[2] + q[3];
+			q += 4;
+			n -= 4;
 		}
-		s = (s + (s >> 16)) & 0xffff;
+		while (n > 0) {
+			s += *q++;
+			n--;
+		}
+		s = (s & 0xffff) + (s >> 16);
+	}
+	if (len > 0) {
+		s += *p; // even address, low byte
 	}
+	s = (s & 0xffff) + (s >> 16);
+	s = (s & 0xffff) + (s >> 16);
+	if (swap) {
+		s = ((s << 8) | (s >> 8)) & 0xffff;
+	}
+	s += sum;
+	s = (s & 0xffff) + (s >> 16);
 	return (uint16_t)s;
 }
 
@@ -238,7 +391,7 @@ void set_ip_checksum(struct ip_frame_t *ip)
 	write_s(&ip->checksum, sum);
 }
 
-void set_udp_checksum(struct udp_frame_t *udp, struct ip_frame_t const *ip)
+static uint16_t udp_pseudo_header_sum(struct ip_frame_t const *ip, int len)
 {
 	struct {
 		uint32_t src;
@@ -247,10 +400,6 @@ void set_udp_checksum(struct udp_frame_t *udp, struct ip_frame_t const *ip)
 		uint8_t protocol;
 		uint16_t length;
 	} header;
-	uint16_t sum;
-	int len = read_s(&udp->length);
-
-	udp->checksum = 0;
 
 	header.src = ip->src;
 	header.dst = ip->dst;
@@ -258,7 +407,17 @@ void set_udp_checksum(struct udp_frame_t *udp, struct ip_frame_t const *ip)
 	header.protocol = ip->protocol;
 	write_s(&header.length, len);
 
-	sum = compute_sum(0, &header, sizeof(header));
+	return compute_sum(0, &header, sizeof(header));
+}
+
+void set_udp_checksum(struct udp_frame_t *udp, struct ip_frame_t const *ip)
+{
+	uint16_t sum;
+	int len = read_s(&udp->length);
+
+	udp->checksum = 0;
+
+	sum = udp_pseudo_header_sum(ip, len);
 	sum = compute_sum(sum, udp, len);
 	sum = ~sum;
 	if (sum == 0) {
@@ -312,6 +471,55 @@ void prepare_udp_packet(struct eth_ip_udp_frame_t *frame, uint8_t const *dstipv4
 	write_s(&frame->udp.length, len);
 }
 
+// sends an IPv4 frame whose headers are complete except for the checksums
+static void send_ip_frame(uint8_t *begin, uint8_t *end)
+{
+	struct frame_t {
+		struct ethernet_frame_t eth;
+		struct ip_frame_t ip;
+	} __attribute__ ((packed)) *frame = (struct frame_t *)begin;
+	uint8_t *p = begin + sizeof(struct frame_t);
+#if IP_CHECKSUM_OFFLOAD
+	struct eth_checksum_t csum[2];
+	int n = 0;
+
+	// the driver computes them in the controller, the fields have to be zero
+	frame->ip.checksum = 0;
+	csum[n].begin = sizeof(struct ethernet_frame_t);
+	csum[n].end = sizeof(struct frame_t);
+	csum[n].field = sizeof(struct ethernet_frame_t) + offsetof(struct ip_frame_t, checksum);
+	csum[n].sum = 0;
+	n++;
+	if (frame->ip.protocol == 17) {
+		struct udp_frame_t *udp = (struct udp_frame_t *)p;
+		int len = read_s(&udp->length);
+		udp->checksum = 0;
+		csum[n].begin = p - begin;
+		csum[n].end = p - begin + len;
+		csum[n].field = p - begin + offsetof(struct udp_frame_t, checksum);
+		csum[n].sum = udp_pseudo_header_sum(&frame->ip, len);
+		n++;
+	} else if (frame->ip.protocol == 1) {
+		struct icmp_frame_t *icmp = (struct icmp_frame_t *)p;
+		icmp->checksum = 0;
+		csum[n].begin = p - begin;
+		csum[n].end = sizeof(struct ethernet_frame_t) + read_s(&frame->ip.total_length);
+		csum[n].field = p - begin + offsetof(struct icmp_frame_t, checksum);
+		csum[n].sum = 0;
+		n++;
+	}
+	eth_send_packet_csum(begin, end - begin, csum, n);
+#else
+	if (frame->ip.protocol == 17) {
+		set_udp_checksum((struct udp_frame_t *)p, &frame->ip);
+	} else if (frame->ip.protocol == 1) {
+		set_icmp_checksum((struct icmp_frame_t *)p, &frame->ip);
+	}
+	set_ip_checksum(&frame->ip);
+	eth_send_packet(begin, end - begin);
+#endif
+}
+
 //
 
 struct dhcp_header_frame_t {
@@ -324,8 +532,12 @@ static void prepare_dhcp(struct dhcp_frame_t *dhcp, uint8_t const *macaddr)
 	dhcp->msg_type = 1;
 	dhcp->hw_type = 1;
 	dhcp->hw_addr_len = 6;
-	write_l(&dhcp->transaction_id, 0x736f7261);
-	write_s(&dhcp->bootp_flags, 0x8000);
+	write_l(&dhcp->transaction_id, ip_stack_globals.dhcp.xid);
+	if (ip_stack_globals.dhcp.state == DHCP_RENEWING || ip_stack_globals.dhcp.state == DHCP_REBINDING) {
+		memcpy(&dhcp->client_ip_addr, ip_stack_globals.ipv4_addr, 4); // the server answers by unicast
+	} else {
+		write_s(&dhcp->bootp_flags, 0x8000); // no address yet, answer by broadcast
+	}
 	memcpy(dhcp->client_mac_addr, macaddr, 6);
 }
 
@@ -334,26 +546,36 @@ static void send_dhcp_packet(struct dhcp_header_frame_t *frame, uint8_t *begin,
 	uint8_t dstaddr[] = {
 		0xff, 0xff, 0xff, 0xff
 	};
-	prepare_udp_packet(&frame->header, dstaddr, 67, 68, end);
+	if (ip_stack_globals.dhcp.state == DHCP_RENEWING) {
+		// unicast to the server of the lease
+		prepare_udp_packet(&frame->header, ip_stack_globals.dhcp.server_id, 67, DHCP_CLIENT_PORT, end);
+		send_ip_packet(begin, end - begin);
+		return;
+	}
+	prepare_udp_packet(&frame->header, dstaddr, 67, DHCP_CLIENT_PORT, end);
 	prepare_ip_packet(&frame->header.ip, end);
-	set_udp_checksum(&frame->header.udp, &frame->header.ip);
-	set_ip_checksum(&frame->header.ip);
-	eth_send_packet(begin, end - begin);
+	if (ip_stack_globals.dhcp.state == DHCP_REBINDING) {
+		memcpy(&frame->header.ip.src, ip_stack_globals.ipv4_addr, 4); // broadcast from the leased address (rfc 2131 4.4.5)
+	}
+	send_ip_frame(begin, end);
 }
 
 void send_dhcp_discover()
 {
-	uint8_t tmp[MAX_FRAME_SIZE];
-	//	uint8_t tmp[304];
+	uint8_t *tmp;
 	uint8_t *p;
 	struct dhcp_header_frame_t *frame;
 
 	uint8_t const *macaddr = ip_stack_globals.mac_addr;
 
+	tmp = borrow_frame();
+	if (!tmp) {
+		return;
+	}
 	frame = (struct dhcp_header_frame_t *)tmp;
 	p = tmp + sizeof(struct dhcp_header_frame_t);
 
-	memset(tmp, 0, sizeof(tmp));
+	memset(tmp, 0, sizeof(struct dhcp_header_frame_t));
 
 	memset(&frame->header.eth.dst, 0xff, 6);
 	memcpy(&frame->header.eth.src, macaddr, 6);
@@ -389,21 +611,25 @@ void send_dhcp_discover()
 	*p++ = 0xff; // End
 
 	send_dhcp_packet(frame, tmp, p);
+	return_frame(tmp);
 }
 
-void send_dhcp_request(struct dhcp_frame_t const *dhcp)
+void send_dhcp_request()
 {
-	uint8_t tmp[MAX_FRAME_SIZE];
-	//	uint8_t tmp[316];
+	uint8_t *tmp;
 	uint8_t *p;
 	struct dhcp_header_frame_t *frame;
 
 	uint8_t const *macaddr = ip_stack_globals.mac_addr;
 
+	tmp = borrow_frame();
+	if (!tmp) {
+		return;
+	}
 	frame = (struct dhcp_header_frame_t *)tmp;
 	p = tmp + sizeof(struct dhcp_header_frame_t);
 
-	memset(tmp, 0, sizeof(tmp));
+	memset(tmp, 0, sizeof(struct dhcp_header_frame_t));
 
 	memset(&frame->header.eth.dst, 0xff, 6);
 	memcpy(&frame->header.eth.src, macaddr, 6);
@@ -429,21 +655,26 @@ void send_dhcp_request(struct dhcp_frame_t const *dhcp)
 	*p++ = macaddr[4];
 	*p++ = macaddr[5];
 
-	*p++ = 0x32; // Requested IP Address
-	*p++ = 0x04;
-	memcpy(p, &dhcp->user_ip_addr, 4);
-	p += 4;
+	if (ip_stack_globals.dhcp.state == DHCP_REQUESTING) {
+		*p++ = 0x32; // Requested IP Address
+		*p++ = 0x04;
+		memcpy(p, ip_stack_globals.dhcp.offered_addr, 4);
+		p += 4;
 
-	*p++ = 0x36; // DHCP Server Identifier
-	*p++ = 0x04;
-	memcpy(p, &dhcp->server_ip_addr, 4);
-	p += 4;
+		*p++ = 0x36; // DHCP Server Identifier
+		*p++ = 0x04;
+		memcpy(p, ip_stack_globals.dhcp.server_id, 4);
+		p += 4;
+	}
 
 	*p++ = 0x37; // Parameter Request List
-	*p++ = 0x03;
+	*p++ = 0x06;
 	*p++ = 0x01; // Subnet Mask
 	*p++ = 0x03; // Router
 	*p++ = 0x06; // Domain Name Server
+	*p++ = 0x33; // IP Address Lease Time
+	*p++ = 0x3a; // Renewal Time
+	*p++ = 0x3b; // Rebinding Time
 
 #if 0
 	*p++ = 0x0c; // Host Name
@@ -490,11 +721,13 @@ void send_dhcp_request(struct dhcp_frame_t const *dhcp)
 	*p++ = 0xff; // End
 
 	send_dhcp_packet(frame, tmp, p);
+	return_frame(tmp);
 }
 
 //
 
-void send_arp_request(uint8_t const *ipv4)
+// mac == 0: broadcast
+static void send_arp_request_to(uint8_t const *ipv4, uint8_t const *mac)
 {
 	struct frame_t {
 		struct ethernet_frame_t eth;
@@ -503,7 +736,11 @@ void send_arp_request(uint8_t const *ipv4)
 
 	memset(&frame, 0, sizeof(struct frame_t));
 
-	memset(frame.eth.dst, 0xff, 6);
+	if (mac) {
+		memcpy(frame.eth.dst, mac, 6);
+	} else {
+		memset(frame.eth.dst, 0xff, 6);
+	}
 	memcpy(frame.eth.src, ip_stack_globals.mac_addr, 6);
 	write_s(&frame.eth.type, 0x0806);
 
@@ -518,6 +755,11 @@ void send_arp_request(uint8_t const *ipv4)
 	eth_send_packet(&frame, sizeof(struct frame_t));
 }
 
+void send_arp_request(uint8_t const *ipv4)
+{
+	send_arp_request_to(ipv4, 0);
+}
+
 void send_arp_response(struct arp_frame_t const *arp)
 {
 	struct frame_t {
@@ -547,16 +789,20 @@ void send_arp_response(struct arp_frame_t const *arp)
 
 void send_icmp_echo_reply(struct ethernet_frame_t const *eth, struct ip_frame_t const *ip, struct icmp_frame_t const *icmp)
 {
-	uint8_t tmp[MAX_FRAME_SIZE];
+	uint8_t *tmp;
 	struct frame_t {
 		struct ethernet_frame_t eth;
 		struct ip_frame_t ip;
 		struct icmp_frame_t icmp;
 	} __attribute__ ((packed)) *frame;
 
+	tmp = borrow_frame();
+	if (!tmp) {
+		return;
+	}
 	frame = (struct frame_t *)tmp;
 
-	memset(tmp, 0, sizeof(tmp));
+	memset(tmp, 0, sizeof(struct frame_t));
 
 	memcpy(frame->eth.dst, eth->src, 6);
 	memcpy(frame->eth.src, ip_stack_globals.mac_addr, 6);
@@ -571,7 +817,7 @@ void send_icmp_echo_reply(struct ethernet_frame_t const *eth, struct ip_frame_t
 	uint16_t ip_total_length = read_s(&ip->total_length);
 	if (ip_total_length >= sizeof(struct ip_frame_t) && sizeof(struct ethernet_frame_t) + ip_total_length <= MAX_FRAME_SIZE) {
 		memcpy(p, icmp, ip_total_length - sizeof(struct ip_frame_t));
-		p += ip_total_length;
+		p += ip_total_length - sizeof(struct ip_frame_t);
 	} else {
 		p += sizeof(struct icmp_frame_t);
 	}
@@ -579,9 +825,8 @@ void send_icmp_echo_reply(struct ethernet_frame_t const *eth, struct ip_frame_t
 	frame->icmp.type = 0; // reply
 
 	prepare_ip_packet(&frame->ip, p);
-	set_ip_checksum(&frame->ip);
-	set_icmp_checksum(&frame->icmp, &frame->ip);
-	eth_send_packet(tmp, p - tmp);
+	send_ip_frame(tmp, p);
+	return_frame(tmp);
 }
 
 
@@ -589,13 +834,16 @@ void send_icmp_echo_reply(struct ethernet_frame_t const *eth, struct ip_frame_t
 
 void ip_stack_term()
 {
-	int i;
-	for (i = 0; i < DNS_CACHE_SIZE; i++) {
-		struct dns_cache_item_t *p = ip_stack_globals.dns_cache[i];
-		if (p) {
-			free(p);
-		}
-	}
+	memset(ip_stack_globals.dns_cache, 0, sizeof(ip_stack_globals.dns_cache));
+}
+
+// seconds since ip_stack_init(), survives the 49 day wrap of milliseconds() as long as it is called now and then
+uint32_t uptime_seconds()
+{
+	uint32_t n = (milliseconds() - ip_stack_globals.uptime_ms) / 1000;
+	ip_stack_globals.uptime_seconds += n;
+	ip_stack_globals.uptime_ms += n * 1000;
+	return ip_stack_globals.uptime_seconds;
 }
 
 void on_icmp_packet(struct ethernet_frame_t const *eth, struct ip_frame_t const *ip, uint8_t *p, bool broadcast)
@@ -626,17 +874,72 @@ bool is_valid_ip_address()
 	return true;
 }
 
+static void dhcp_set_state(int state)
+{
+	struct dhcp_client_t *d = &ip_stack_globals.dhcp;
+	bool had_broadcast = d->state == DHCP_SELECTING || d->state == DHCP_REQUESTING;
+	bool need_broadcast = state == DHCP_SELECTING || state == DHCP_REQUESTING; // offer and ack are broadcast
+	if (need_broadcast && !had_broadcast) {
+		eth_add_filter(ETH_FILTER_BROADCAST);
+	} else if (!need_broadcast && had_broadcast) {
+		eth_remove_filter(ETH_FILTER_BROADCAST);
+	}
+	if (state == DHCP_SELECTING || state == DHCP_RENEWING || state == DHCP_REBINDING) {
+		d->xid = random32(); // a new exchange, the request for an offer keeps the xid of the discover
+	}
+	d->state = state;
+	d->retry = 0;
+}
+
+static void dhcp_transmit()
+{
+	struct dhcp_client_t *d = &ip_stack_globals.dhcp;
+	if (d->state == DHCP_SELECTING) {
+		send_dhcp_discover();
+	} else {
+		send_dhcp_request();
+	}
+	d->tick = milliseconds();
+	if (d->state == DHCP_RENEWING || d->state == DHCP_REBINDING) {
+		// rfc 2131 4.4.5: half of the remaining time, but at least a minute
+		uint32_t elapsed = uptime_seconds() - d->lease_start;
+		uint32_t end = d->state == DHCP_RENEWING ? d->t2 : d->lease_time;
+		uint32_t n = end > elapsed ? (end - elapsed) / 2 : 0;
+		if (n < DHCP_RENEW_INTERVAL_MIN) {
+			n = DHCP_RENEW_INTERVAL_MIN;
+		} else if (n > 24 * 60 * 60) {
+			n = 24 * 60 * 60;
+		}
+		d->interval = n * 1000;
+	} else {
+		uint32_t n = DHCP_RETRY_INTERVAL << (d->retry < 4 ? d->retry : 4);
+		d->interval = (n < DHCP_RETRY_INTERVAL_MAX ? n : DHCP_RETRY_INTERVAL_MAX) + random32() % 1000;
+	}
+}
+
+static void dhcp_restart()
+{
+	memset(ip_stack_globals.ipv4_addr, 0, 4);
+	dhcp_set_state(DHCP_SELECTING);
+	dhcp_transmit();
+}
+
 void process_dhcp_options(struct dhcp_frame_t *dhcp, uint8_t const *begin, uint8_t const *end)
 {
+	struct dhcp_client_t *d = &ip_stack_globals.dhcp;
 	uint8_t const *p = begin;
 	uint8_t subnet_mask[4];
 	uint8_t gateway_addr[4];
 	uint8_t dns_addr[4];
-	bool dhcp_ack = false;
-	bool offer = false;
+	uint8_t server_id[4];
+	uint32_t lease_time = 0;
+	uint32_t t1 = 0;
+	uint32_t t2 = 0;
+	int type = 0;
 	memset(subnet_mask, 0, 4);
 	memset(gateway_addr, 0, 4);
 	memset(dns_addr, 0, 4);
+	memset(server_id, 0, 4);
 	while (p + 1 < end && p[0] != 0xff && p + 2 + p[1] <= end) {
 		uint8_t option = p[0];
 		uint8_t len = p[1];
@@ -644,32 +947,12 @@ void process_dhcp_options(struct dhcp_frame_t *dhcp, uint8_t const *begin, uint8
 		switch (option) {
 		case 53: // dhcp message type
 			if (len == 1) {
-				if (p[0] == 2) { // offer
-					if (is_valid_ip_address()) {
-						break;
-					}
-					if (ip_stack_globals.state != STATE_SENT_DHCP_DISCOVER) {
-						break;
-					}
-					if (ip_stack_globals.dhcp_ack_waiting != 0) {
-						break;
-					}
-					offer = true;
-				} else if (p[0] == 5) { // ack
-					if (ip_stack_globals.state == STATE_SENT_DHCP_DISCOVER && ip_stack_globals.dhcp_ack_waiting > 0) {
-						dhcp_ack = true;
-					}
-					ip_stack_globals.state = STATE_IDLE;
-					ip_stack_globals.dhcp_ack_waiting = 0;
-				} else if (p[0] == 6) { // nack
-					ip_stack_globals.state = STATE_DHCP_NACK;
-					ip_stack_globals.dhcp_ack_waiting = 0;
-				}
+				type = p[0];
 			}
 			break;
 		case 54: // dhcp server identifier
 			if (len == 4) {
-				memcpy(&dhcp->server_ip_addr, p, 4);
+				memcpy(server_id, p, 4);
 			}
 			break;
 		case 1: // subnet mask
@@ -678,28 +961,119 @@ void process_dhcp_options(struct dhcp_frame_t *dhcp, uint8_t const *begin, uint8
 			}
 			break;
 		case 3: // default gateway
-			if (len == 4) {
+			if (len >= 4) {
 				memcpy(gateway_addr, p, 4);
 			}
 			break;
 		case 6: // DNS
-			if (len == 4) {
+			if (len >= 4) {
 				memcpy(dns_addr, p, 4);
 			}
 			break;
+		case 51: // lease time
+			if (len == 4) {
+				lease_time = read_l((uint32_t const *)p);
+			}
+			break;
+		case 58: // renewal (t1) time
+			if (len == 4) {
+				t1 = read_l((uint32_t const *)p);
+			}
+			break;
+		case 59: // rebinding (t2) time
+			if (len == 4) {
+				t2 = read_l((uint32_t const *)p);
+			}
+			break;
 		}
 		p += len;
 	}
-	if (offer) {
-		send_dhcp_request(dhcp);
-		ip_stack_globals.dhcp_ack_waiting = 1;
+
+	if (type == 2) { // offer
+		if (d->state != DHCP_SELECTING || is_addr_zero(server_id)) {
+			return;
+		}
+		memcpy(d->offered_addr, &dhcp->user_ip_addr, 4);
+		memcpy(d->server_id, server_id, 4);
+		dhcp_set_state(DHCP_REQUESTING);
+		dhcp_transmit();
+		return;
+	}
+
+	if (d->state != DHCP_REQUESTING && d->state != DHCP_RENEWING && d->state != DHCP_REBINDING) {
+		return;
 	}
-	if (dhcp_ack) {
+
+	if (type == 6) { // nack
+		dhcp_restart();
+		return;
+	}
+
+	if (type == 5) { // ack
 		memcpy(ip_stack_globals.ipv4_addr, &dhcp->user_ip_addr, 4);
-		memcpy(ip_stack_globals.subnet_mask, subnet_mask, 4);
-		memcpy(ip_stack_globals.gateway_addr, gateway_addr, 4);
-		memcpy(ip_stack_globals.dns_addr, dns_addr, 4);
+		// a renewal may leave out what did not change
+		if (!is_addr_zero(subnet_mask)) {
+			memcpy(ip_stack_globals.subnet_mask, subnet_mask, 4);
+		}
+		if (!is_addr_zero(gateway_addr)) {
+			memcpy(ip_stack_globals.gateway_addr, gateway_addr, 4);
+		}
+		if (!is_addr_zero(dns_addr)) {
+			memcpy(ip_stack_globals.dns_addr, dns_addr, 4);
+		}
+		if (!is_addr_zero(server_id)) {
+			memcpy(d->server_id, server_id, 4);
+		}
+		d->lease_time = lease_time ? lease_time : 0xffffffff;
+		d->t1 = t1 && t1 < d->lease_time ? t1 : d->lease_time / 2;
+		d->t2 = t2 && t2 > d->t1 && t2 < d->lease_time ? t2 : d->lease_time / 8 * 7;
+		if (d->t1 >= d->t2) {
+			d->t1 = d->t2 / 2;
+		}
+		d->lease_start = uptime_seconds();
+		dhcp_set_state(DHCP_BOUND);
+	}
+}
+
+// timers of the lease, driven from ip_stack_process()
+static void process_dhcp()
+{
+	struct dhcp_client_t *d = &ip_stack_globals.dhcp;
+	if (d->state == DHCP_OFF) {
+		return;
+	}
+	if (d->state >= DHCP_BOUND && d->lease_time != 0xffffffff) {
+		uint32_t elapsed = uptime_seconds() - d->lease_start;
+		if (elapsed >= d->lease_time) {
+			dhcp_restart(); // the address is no longer ours
+			return;
+		}
+		if (elapsed >= d->t2 && d->state != DHCP_REBINDING) {
+			dhcp_set_state(DHCP_REBINDING);
+			dhcp_transmit();
+			return;
+		}
+		if (elapsed >= d->t1 && d->state == DHCP_BOUND) {
+			dhcp_set_state(DHCP_RENEWING);
+			dhcp_transmit();
+			return;
+		}
+	}
+	if (d->state == DHCP_BOUND || milliseconds() - d->tick < d->interval) {
+		return;
 	}
+	d->retry++;
+	if (d->state == DHCP_REQUESTING && d->retry >= DHCP_REQUEST_RETRY) {
+		dhcp_set_state(DHCP_SELECTING); // the offer is gone, start over
+	}
+	dhcp_transmit();
+}
+
+void dhcp_start()
+{
+	memset(ip_stack_globals.ipv4_addr, 0, 4);
+	ip_stack_globals.dhcp.lease_time = 0;
+	dhcp_restart();
 }
 
 uint8_t const *skip_dns_name_field(uint8_t const *ptr, uint8_t const *end)
@@ -723,8 +1097,9 @@ void process_dns_response(struct dns_frame_t const *dns, uint8_t const *end)
 	unsigned int i;
 	uint8_t const *p = (uint8_t const *)dns + sizeof(struct dns_frame_t);
 
-	uint8_t host_addr[4];
-	bool host_addr_is_valid = false;
+	uint8_t host_addr[DNS_CACHE_ADDRS][4];
+	int host_addr_count = 0;
+	uint32_t ttl = DNS_TTL_MAX;
 
 	uint16_t questions = read_s(&dns->questions);
 	uint16_t answers_rrs = read_s(&dns->answer_rrs);
@@ -749,13 +1124,14 @@ void process_dns_response(struct dns_frame_t const *dns, uint8_t const *end)
 				p += 2;
 				cls = read_s((uint16_t const *)p);
 				p += 2;
-				p += 4; // time to live
+				uint32_t t = read_l((uint32_t const *)p); // time to live
+				p += 4;
 				datalen = read_s((uint16_t const *)p);
 				p += 2;
-				if (type == 1 && !host_addr_is_valid) { // A
-					if (datalen == 4 && p + datalen < end) {
-						memcpy(host_addr, p, 4);
-						host_addr_is_valid = true;
+				if (type == 1 && cls == 1 && datalen == 4 && p + datalen <= end && host_addr_count < DNS_CACHE_ADDRS) { // A
+					memcpy(host_addr[host_addr_count++], p, 4);
+					if (t < ttl) {
+						ttl = t;
 					}
 				}
 				p += datalen; // primary name
@@ -801,47 +1177,124 @@ void process_dns_response(struct dns_frame_t const *dns, uint8_t const *end)
 		}
 	}
 
-	if (host_addr_is_valid) {
-		uint16_t tran_id = read_s(&dns->transaction_id);
-		for (i = 0; i < DNS_CACHE_SIZE; i++) {
-			struct dns_cache_item_t *item = ip_stack_globals.dns_cache[i];
-			if (item && tran_id == item->transaction_id) {
-				memcpy(item->ipv4, host_addr, 4);
-				item->valid_address = true;
+	// a response without an A record (NXDOMAIN etc.) fails the query right away
+	uint16_t tran_id = read_s(&dns->transaction_id);
+	for (i = 0; i < DNS_QUERY_COUNT; i++) {
+		struct dns_query_t *q = &ip_stack_globals.dns_queries[i];
+		if (q->status == DNS_PENDING && q->transaction_id == tran_id) {
+			if (host_addr_count > 0) {
+				dns_cache_add(q->name, host_addr, host_addr_count, ttl);
 			}
+			finish_dns_query(q, host_addr_count > 0 ? host_addr[0] : 0);
+			break;
 		}
 	}
 }
 
-void on_udp_packet(struct ip_frame_t const *ip, uint8_t *p, bool broadcast)
+static void on_dhcp_packet(void *ctx, uint8_t const *srcipv4, uint16_t srcport, uint16_t dstport, uint8_t const *data, uint16_t len)
+{
+	struct dhcp_frame_t *dhcp = (struct dhcp_frame_t *)data;
+	if (len < sizeof(struct dhcp_frame_t) || dhcp->msg_type != 2) { // boot reply
+		return;
+	}
+	if (read_l(&dhcp->transaction_id) != ip_stack_globals.dhcp.xid || memcmp(dhcp->client_mac_addr, ip_stack_globals.mac_addr, 6) != 0) {
+		return; // for another client
+	}
+	if (read_l(&dhcp->magic_cookie) == DHCP_MAGIC_COOKIE) {
+		process_dhcp_options(dhcp, data + sizeof(struct dhcp_frame_t), data + len);
+	}
+}
+
+static void on_dns_packet(void *ctx, uint8_t const *srcipv4, uint16_t srcport, uint16_t dstport, uint8_t const *data, uint16_t len)
+{
+	// only the server we asked, a spoofed reply would also have to guess the transaction id
+	if (srcport == 53 && memcmp(srcipv4, ip_stack_globals.dns_addr, 4) == 0) {
+		process_dns_response((struct dns_frame_t const *)data, data + len);
+	}
+}
+
+static struct udp_binding_t *find_udp_binding(uint16_t port)
+{
+	int i;
+	for (i = 0; i < UDP_BINDING_COUNT; i++) {
+		if (ip_stack_globals.udp_bindings[i].port == port) {
+			return &ip_stack_globals.udp_bindings[i];
+		}
+	}
+	return 0;
+}
+
+bool udp_bind(uint16_t port, udp_handler_t handler, void *ctx)
+{
+	struct udp_binding_t *b;
+	if (port == 0) {
+		return false;
+	}
+	b = find_udp_binding(port);
+	if (!b) {
+		b = find_udp_binding(0);
+		if (!b) {
+			return false;
+		}
+	}
+	b->port = port;
+	b->handler = handler;
+	b->ctx = ctx;
+	return true;
+}
+
+void udp_unbind(uint16_t port)
+{
+	struct udp_binding_t *b = find_udp_binding(port);
+	if (b && port != 0) {
+		memset(b, 0, sizeof(struct udp_binding_t));
+	}
+}
+
+static void queue_udp_packet(struct ip_frame_t const *ip, struct udp_frame_t const *udp, uint8_t const *data, uint16_t len)
+{
+	if (len > UDP_PACKET_DATA_SIZE) {
+		ip_stack_globals.stats.udp_too_large++;
+		return;
+	}
+	if (ip_stack_globals.udp_packet_count >= UDP_PACKET_BUFFER_SIZE) {
+		ip_stack_globals.stats.udp_ring_full++;
+		return;
+	}
+	int i = (ip_stack_globals.udp_packet_head + ip_stack_globals.udp_packet_count) % UDP_PACKET_BUFFER_SIZE;
+	struct packet_header_t *packet = (struct packet_header_t *)ip_stack_globals.udp_packets[i];
+	memcpy(packet->src_addr, &ip->src, 4);
+	packet->src_port = read_s(&udp->src_port);
+	packet->dst_port = read_s(&udp->dst_port);
+	packet->length = len;
+	memcpy(packet->data, data, len);
+	ip_stack_globals.udp_packet_count++;
+}
+
+void on_udp_packet(struct ip_frame_t const *ip, uint8_t *p, uint8_t const *end, bool broadcast)
 {
 	struct udp_frame_t *udp = (struct udp_frame_t *)p;
-	uint16_t len = read_s(&udp->length);
-	uint8_t const *end = (uint8_t const *)udp;
-	end += len;
+	uint16_t len;
+	struct udp_binding_t *b;
+	if (p + sizeof(struct udp_frame_t) > end) {
+		return;
+	}
+	len = read_s(&udp->length);
+	if (len < sizeof(struct udp_frame_t) || len > end - p) {
+		return; // the udp length must fit in the ip payload
+	}
+	len -= sizeof(struct udp_frame_t);
 	p += sizeof(struct udp_frame_t);
-	if (ntohs(udp->dst_port) == 68) {
-		struct dhcp_frame_t *dhcp = (struct dhcp_frame_t *)p;
-		if (read_l(&dhcp->magic_cookie) == DHCP_MAGIC_COOKIE) {
-			process_dhcp_options(dhcp, p + sizeof(struct dhcp_frame_t), end);
-		}
-	} else if (ntohs(udp->src_port) == 53) {
-		struct dns_frame_t *dns = (struct dns_frame_t *)p;
-		process_dns_response(dns, end);
+	b = find_udp_binding(read_s(&udp->dst_port));
+	if (!b || b->port == 0) {
+		ip_stack_globals.stats.udp_no_port++;
+		return;
+	}
+	if (b->handler) {
+		// dispatched while the datagram is still in the receive frame
+		b->handler(b->ctx, (uint8_t const *)&ip->src, read_s(&udp->src_port), b->port, p, len);
 	} else {
-		if (len >= sizeof(struct udp_frame_t) && len <= MAX_FRAME_SIZE && ip_stack_globals.udp_packet_count < UDP_PACKET_BUFFER_SIZE) {
-			struct packet_header_t *packet = (struct packet_header_t *)malloc(sizeof(struct packet_header_t) + len);
-			if (!packet) {
-				// not enough memory ?
-				return;
-			}
-			memcpy(packet->src_addr, &ip->src, 4);
-			packet->src_port = read_s(&udp->src_port);
-			packet->dst_port = read_s(&udp->dst_port);
-			packet->length = len - sizeof(struct udp_frame_t);
-			memcpy(packet->data, p, packet->length);
-			ip_stack_globals.udp_packets[ip_stack_globals.udp_packet_count++] = packet;
-		}
+		queue_udp_packet(ip, udp, p, len);
 	}
 }
 
@@ -850,9 +1303,38 @@ void eth_on_ip_packet(uint8_t *buf, int len, bool broadcast)
 	struct ip_frame_t *ip = (struct ip_frame_t *)(buf + sizeof(struct ethernet_frame_t));
 	if ((ip->version_and_length & 0xf0) == 0x40) {
 		uint8_t *p = (uint8_t *)ip;
+		uint8_t *end = (uint8_t *)ip + read_s(&ip->total_length); // without the ethernet padding
 		p += (ip->version_and_length & 0x0f) * 4;
+		if (end > buf + len) {
+			end = buf + len;
+		}
+		if (p > end) {
+			return;
+		}
+#if !IP_CHECKSUM_OFFLOAD
+		// with offload the driver has verified the checksums already
+		if (compute_sum(0, ip, p - (uint8_t *)ip) != 0xffff) {
+			return;
+		}
+		if (ip->protocol == 17 && p + sizeof(struct udp_frame_t) <= end) {
+			struct udp_frame_t *udp = (struct udp_frame_t *)p;
+			int n = read_s(&udp->length);
+			if (udp->checksum != 0 && (p + n > end || compute_sum(udp_pseudo_header_sum(ip, n), udp, n) != 0xffff)) {
+				return;
+			}
+		}
+#endif
+		if (!broadcast && memcmp(&ip->dst, ip_stack_globals.ipv4_addr, 4) == 0) {
+			// learn the sender, or keep the gateway entry alive while its traffic comes in
+			struct ethernet_frame_t const *eth = (struct ethernet_frame_t *)buf;
+			if ((ip->src & get_ip_subnet_mask()) == (get_ip_address() & get_ip_subnet_mask())) {
+				arp_cache_update((uint8_t const *)&ip->src, eth->src, true);
+			} else {
+				arp_cache_refresh(ip_stack_globals.gateway_addr, eth->src);
+			}
+		}
 		if (ip->protocol == 17) {
-			on_udp_packet(ip, p, broadcast);
+			on_udp_packet(ip, p, end, broadcast);
 			return;
 		}
 		if (ip->protocol == 1) {
@@ -881,33 +1363,30 @@ void eth_on_arp_packet(uint8_t *buf, int len, bool broadcast)
 	frame = (struct frame_t *)buf;
 
 	int opcode = ntohs(frame->arp.opode);
+	bool for_us = memcmp(&frame->arp.target_ip_addr, ip_stack_globals.ipv4_addr, 4) == 0;
 
-	if (opcode == 1 && memcmp(&frame->arp.target_ip_addr, ip_stack_globals.ipv4_addr, 4) == 0) {
-		send_arp_response(&frame->arp);
-		return;
-	}
-
-	if (broadcast) {
-		return;
+	// rfc 826: update a known sender from any arp packet, add it when the packet is for us
+	if (frame->arp.sender_ip_addr != 0) {
+		arp_cache_update((uint8_t const *)&frame->arp.sender_ip_addr, frame->arp.sender_mac_addr, for_us);
+		process_arp_pending((uint8_t const *)&frame->arp.sender_ip_addr);
 	}
 
-	if (opcode == 2) {
-		int i;
-		for (i = 0; i < ARP_CACHE_SIZE - 1; i++) {
-			if (!ip_stack_globals.arp_cache[i].valid || memcmp(ip_stack_globals.arp_cache[i].ipv4, ip_stack_globals.ipv4_addr, 4) == 0) {
-				break;
-			}
-		}
-		memcpy(ip_stack_globals.arp_cache[i].ipv4, &frame->arp.sender_ip_addr, 4);
-		memcpy(ip_stack_globals.arp_cache[i].mac, frame->arp.sender_mac_addr, 6);
-		ip_stack_globals.arp_cache[i].valid = true;
-		return;
+	if (opcode == 1 && for_us) {
+		send_arp_response(&frame->arp);
 	}
 }
 
 void ip_stack_process()
 {
-	uint8_t tmp[MAX_FRAME_SIZE];
+	uint8_t *tmp;
+	uptime_seconds();
+	process_dhcp();
+	process_arp_pending(0);
+	process_dns_queries();
+	tmp = borrow_frame();
+	if (!tmp) {
+		return; // nested too deep, the frames stay queued in the controller
+	}
 	while (1) {
 		struct ethernet_frame_t *eth;
 		unsigned int len = eth_recv_packet(tmp, MAX_FRAME_SIZE);
@@ -934,65 +1413,142 @@ void ip_stack_process()
 			continue;
 		}
 	}
+	return_frame(tmp);
 }
 
-static void arp_cache_move_to_front(int i)
+static struct arp_cache_item_t *arp_cache_find(uint8_t const *ipv4, bool create)
 {
-	if (i < 1 || i >= ARP_CACHE_SIZE) {
-		return;
+	uint32_t a = ((uint32_t)ipv4[0] << 24) | (ipv4[1] << 16) | (ipv4[2] << 8) | ipv4[3];
+	int h = (a * 2654435761u) >> 16; // hosts of one subnet differ in the low bits
+	struct arp_cache_item_t *oldest = 0;
+	int i;
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		struct arp_cache_item_t *item = &ip_stack_globals.arp_cache[(h + i) % ARP_CACHE_SIZE];
+		if (!item->valid) {
+			return create ? item : 0; // end of the probe sequence
+		}
+		if (memcmp(item->ipv4, ipv4, 4) == 0) {
+			return item;
+		}
+		if (!oldest || (int32_t)(item->updated - oldest->updated) < 0) {
+			oldest = item;
+		}
 	}
-	struct arp_cache_item_t item;
-	memcpy(&item, &ip_stack_globals.arp_cache[i], sizeof(struct arp_cache_item_t));
-	memmove(ip_stack_globals.arp_cache + 1, ip_stack_globals.arp_cache, sizeof(struct arp_cache_item_t) * i);
-	memcpy(&ip_stack_globals.arp_cache[i], &item, sizeof(struct arp_cache_item_t));
+	return create ? oldest : 0;
 }
 
-int find_mac_from_arp_cache(uint8_t const *ipv4)
+static void arp_cache_update(uint8_t const *ipv4, uint8_t const *mac, bool create)
 {
-	int i;
-	for (i = 0; i < ARP_CACHE_SIZE; i++) {
-		if (ip_stack_globals.arp_cache[i].valid && memcmp(ip_stack_globals.arp_cache[i].ipv4, ipv4, 4) == 0) {
-			return i;
-		}
+	struct arp_cache_item_t *item = arp_cache_find(ipv4, false);
+	if (!item && create) {
+		item = arp_cache_find(ipv4, true);
+		memcpy(item->ipv4, ipv4, 4);
+		item->valid = true;
+	}
+	if (item) {
+		memcpy(item->mac, mac, 6); // picks up a changed mac address, too
+		item->updated = uptime_seconds();
+		item->requested = item->updated;
+	}
+}
+
+// traffic relayed by the gateway confirms its entry, unless it came from a different mac address
+static void arp_cache_refresh(uint8_t const *ipv4, uint8_t const *mac)
+{
+	struct arp_cache_item_t *item = arp_cache_find(ipv4, false);
+	if (item && memcmp(item->mac, mac, 6) == 0) {
+		item->updated = uptime_seconds();
 	}
-	return -1;
 }
 
 bool get_mac_from_ipv4(uint8_t const *ipv4, uint8_t *mac)
+{
+	struct arp_cache_item_t *item = arp_cache_find(ipv4, false);
+	uint32_t now = uptime_seconds();
+	if (!item || now - item->updated >= ARP_CACHE_TIMEOUT) {
+		return false;
+	}
+	if (now - item->updated >= ARP_REFRESH_AGE && now != item->requested) {
+		// ask the current holder directly before the entry runs out
+		send_arp_request_to(ipv4, item->mac);
+		item->requested = now;
+	}
+	memcpy(mac, item->mac, 6);
+	return true;
+}
+
+// keeps a copy of the frame until the next hop answers our arp request
+static bool queue_arp_pending(uint8_t const *ipv4, uint8_t const *packet, int length)
 {
 	int i;
-	int retry;
-	i = find_mac_from_arp_cache(ipv4);
-	if (i >= 0) {
-		goto found;
+	bool requested = false;
+	struct arp_pending_item_t *item = 0;
+	for (i = 0; i < ARP_PENDING_SIZE; i++) {
+		struct arp_pending_item_t *p = &ip_stack_globals.arp_pending[i];
+		if (!p->frame) {
+			if (!item) {
+				item = p;
+			}
+		} else if (memcmp(p->ipv4, ipv4, 4) == 0) {
+			requested = true; // share the request already on the wire
+		}
 	}
-	retry = 0;
-	while (1) {
-		uint32_t start_tick = milliseconds();
+	if (!item) {
+		return false;
+	}
+	item->frame = borrow_frame();
+	if (!item->frame) {
+		return false;
+	}
+	memcpy(item->frame, packet, length);
+	item->length = length;
+	memcpy(item->ipv4, ipv4, 4);
+	item->tick = milliseconds();
+	item->retry = 0;
+	if (!requested) {
 		send_arp_request(ipv4);
-		while (1) {
-			if (milliseconds() - start_tick > 1000) {
-				break;
-			}
-			ip_stack_process();
-			i = find_mac_from_arp_cache(ipv4);
-			if (i >= 0) {
-				goto found;
-			}
+	}
+	return true;
+}
+
+// resolved: address just added to the arp cache, 0: check the timers
+static void process_arp_pending(uint8_t const *resolved)
+{
+	int i;
+	for (i = 0; i < ARP_PENDING_SIZE; i++) {
+		struct arp_pending_item_t *item = &ip_stack_globals.arp_pending[i];
+		struct ethernet_frame_t *eth = (struct ethernet_frame_t *)item->frame;
+		if (!item->frame) {
+			continue;
 		}
-		retry++;
-		if (retry >= 5) {
-			return false;
+		if (resolved && memcmp(item->ipv4, resolved, 4) != 0) {
+			continue;
+		}
+		if (get_mac_from_ipv4(item->ipv4, eth->dst)) {
+			send_ip_frame(item->frame, item->frame + item->length);
+		} else if (resolved || milliseconds() - item->tick < ARP_RETRY_INTERVAL) {
+			continue;
+		} else if (++item->retry < ARP_RETRY_COUNT) {
+			send_arp_request(item->ipv4);
+			item->tick = milliseconds();
+			continue;
+		} else if (ip_stack_globals.send_error_handler) {
+			struct ip_frame_t const *ip = (struct ip_frame_t const *)(item->frame + sizeof(struct ethernet_frame_t));
+			ip_stack_globals.send_error_handler((uint8_t const *)&ip->dst);
 		}
+		return_frame(item->frame);
+		item->frame = 0;
 	}
-found:;
-	memcpy(mac, ip_stack_globals.arp_cache[i].mac, 6);
-	arp_cache_move_to_front(i);
-	return true;
+}
+
+void ip_set_send_error_handler(void (*handler)(uint8_t const *dstipv4))
+{
+	ip_stack_globals.send_error_handler = handler;
 }
 
 void ip_config(uint8_t const *ipv4, uint8_t const *mask, uint8_t const *gateway, uint8_t const *dns)
 {
+	dhcp_set_state(DHCP_OFF);
 	memcpy(ip_stack_globals.ipv4_addr, ipv4, 4);
 	memcpy(ip_stack_globals.subnet_mask, mask, 4);
 	memcpy(ip_stack_globals.gateway_addr, gateway, 4);
@@ -1001,38 +1557,27 @@ void ip_config(uint8_t const *ipv4, uint8_t const *mask, uint8_t const *gateway,
 
 bool ip_config_with_dhcp()
 {
-	int retry = 0;
-	while (1) {
-		send_dhcp_discover();
-		ip_stack_globals.dhcp_ack_waiting = 0;
-		ip_stack_globals.state = STATE_SENT_DHCP_DISCOVER;
-		uint32_t start_tick = milliseconds();
-		while (1) {
-			if (ip_stack_globals.state == STATE_IDLE) {
-				return true;
-			}
-			ip_stack_process();
-			if (milliseconds() - start_tick >= 2000) {
-				break;
-			}
-		}
-		retry++;
-		if (retry >= 5) {
-			break;
+	uint32_t start_tick = milliseconds();
+	dhcp_start();
+	while (ip_stack_globals.dhcp.state != DHCP_BOUND) {
+		if (milliseconds() - start_tick >= DHCP_BOOT_TIMEOUT) {
+			return false; // keeps trying in the background
 		}
+		ip_stack_process();
 	}
-	return false;
+	return true;
 }
 
-bool send_ip_packet(uint8_t *packet, int length)
+int send_ip_packet(uint8_t *packet, int length)
 {
 	struct frame_t {
 		struct ethernet_frame_t eth;
 		struct ip_frame_t ip;
 	} *frame;
+	uint8_t nexthop[4];
 
 	if (length < sizeof(struct ethernet_frame_t) + sizeof(struct ip_frame_t)) {
-		return false;
+		return IP_SEND_FAILED;
 	}
 
 	frame = (struct frame_t *)packet;
@@ -1043,18 +1588,6 @@ bool send_ip_packet(uint8_t *packet, int length)
 	write_s(&frame->ip.flags_and_fragment_offset, 0);
 	frame->ip.time_to_live = 64;
 
-	if ((frame->ip.dst & get_ip_subnet_mask()) == (get_ip_address() & get_ip_subnet_mask())) {
-		if (!get_mac_from_ipv4((uint8_t const *)&frame->ip.dst, frame->eth.dst)) {
-			return false;
-		}
-	} else if (frame->ip.dst == 0xffffffff) {
-		memset(frame->eth.dst, 0xff, 6);
-	} else {
-		if (!get_mac_from_ipv4(ip_stack_globals.gateway_addr, frame->eth.dst)) {
-			return false;
-		}
-	}
-
 	memcpy(&frame->ip.src, ip_stack_globals.ipv4_addr, 4);
 	write_s(&frame->eth.type, 0x0800);
 
@@ -1062,90 +1595,216 @@ bool send_ip_packet(uint8_t *packet, int length)
 
 	set_ip_identifier(&frame->ip);
 
-	if (frame->ip.protocol == 17) {
-		struct udp_frame_t *udp = (struct udp_frame_t *)(packet + sizeof(struct ethernet_frame_t) + sizeof(struct ip_frame_t));
-		set_udp_checksum(udp, &frame->ip);
+	prepare_ip_packet(&frame->ip, packet + length);
+
+	if ((frame->ip.dst & get_ip_subnet_mask()) == (get_ip_address() & get_ip_subnet_mask())) {
+		memcpy(nexthop, &frame->ip.dst, 4);
+	} else if (frame->ip.dst == 0xffffffff) {
+		memset(frame->eth.dst, 0xff, 6);
+		send_ip_frame(packet, packet + length);
+		return IP_SEND_OK;
+	} else {
+		memcpy(nexthop, ip_stack_globals.gateway_addr, 4);
 	}
 
-	prepare_ip_packet(&frame->ip, packet + length);
+	if (get_mac_from_ipv4(nexthop, frame->eth.dst)) {
+		send_ip_frame(packet, packet + length);
+		return IP_SEND_OK;
+	}
 
-	set_ip_checksum(&frame->ip);
-	eth_send_packet(packet, length);
+	// sent from ip_stack_process() once the next hop answers
+	return queue_arp_pending(nexthop, packet, length) ? IP_SEND_PENDING : IP_SEND_FAILED;
+}
 
-	return true;
+uint8_t *reserve_udp_packet(uint16_t maxlen)
+{
+	uint8_t *frame;
+	if (sizeof(struct eth_ip_udp_frame_t) + maxlen > MAX_FRAME_SIZE) {
+		return 0;
+	}
+	frame = borrow_frame();
+	if (!frame) {
+		return 0;
+	}
+	return frame + sizeof(struct eth_ip_udp_frame_t);
 }
 
-bool send_udp_packet(uint8_t const *dstipv4, uint16_t dstport, uint16_t srcport, uint8_t const *ptr, uint16_t len)
+int commit_udp_packet(uint8_t *payload, uint8_t const *dstipv4, uint16_t dstport, uint16_t srcport, uint16_t len)
 {
-	uint8_t tmp[MAX_FRAME_SIZE];
+	uint8_t *frame = payload - sizeof(struct eth_ip_udp_frame_t);
+	int ok = IP_SEND_FAILED;
 
-	if (sizeof(struct eth_ip_udp_frame_t) + len > MAX_FRAME_SIZE) {
-		return false;
+	if (sizeof(struct eth_ip_udp_frame_t) + len <= MAX_FRAME_SIZE) {
+		memset(frame, 0, sizeof(struct eth_ip_udp_frame_t));
+		prepare_udp_packet((struct eth_ip_udp_frame_t *)frame, dstipv4, dstport, srcport, payload + len);
+		ok = send_ip_packet(frame, sizeof(struct eth_ip_udp_frame_t) + len);
 	}
+	return_frame(frame);
+	return ok;
+}
 
-	uint8_t *p = tmp + sizeof(struct eth_ip_udp_frame_t);
+int send_udp_packet(uint8_t const *dstipv4, uint16_t dstport, uint16_t srcport, uint8_t const *ptr, uint16_t len)
+{
+	uint8_t *p = reserve_udp_packet(len);
+	if (!p) {
+		return IP_SEND_FAILED;
+	}
 	memcpy(p, ptr, len);
-	p += len;
+	return commit_udp_packet(p, dstipv4, dstport, srcport, len);
+}
 
-	prepare_udp_packet((struct eth_ip_udp_frame_t *)tmp, dstipv4, dstport, srcport, p);
+struct packet_header_t *borrow_udp_packet()
+{
+	if (ip_stack_globals.udp_packet_count < 1) {
+		return 0;
+	}
+	return (struct packet_header_t *)ip_stack_globals.udp_packets[ip_stack_globals.udp_packet_head];
+}
 
-	return send_ip_packet(tmp, p - tmp);
+void release_udp_packet(struct packet_header_t *packet)
+{
+	if (ip_stack_globals.udp_packet_count < 1 || packet != borrow_udp_packet()) {
+		return;
+	}
+	ip_stack_globals.udp_packet_head = (ip_stack_globals.udp_packet_head + 1) % UDP_PACKET_BUFFER_SIZE;
+	ip_stack_globals.udp_packet_count--;
 }
 
 struct packet_header_t *take_udp_packet()
 {
-	struct packet_header_t *packet;
-	if (ip_stack_globals.udp_packet_count < 1) {
+	struct packet_header_t *packet = borrow_udp_packet();
+	struct packet_header_t *copy;
+	if (!packet) {
 		return 0;
 	}
-	packet = ip_stack_globals.udp_packets[0];
-	ip_stack_globals.udp_packet_count--;
-	memmove(ip_stack_globals.udp_packets, ip_stack_globals.udp_packets + 1, sizeof(struct packet_header_t *) * ip_stack_globals.udp_packet_count);
-	return packet;
+	copy = (struct packet_header_t *)malloc(sizeof(struct packet_header_t) + packet->length);
+	if (copy) {
+		memcpy(copy, packet, sizeof(struct packet_header_t) + packet->length);
+	}
+	release_udp_packet(packet);
+	return copy;
 }
 
-bool query_dns(char const *name, uint8_t *ipv4)
+static uint32_t dns_name_hash(char const *name)
+{
+	uint32_t h = 2166136261u; // FNV-1a, names compare case insensitive
+	while (*name) {
+		h = (h ^ (uint8_t)tolower((uint8_t)*name++)) * 16777619u;
+	}
+	return h ? h : 1;
+}
+
+static struct dns_cache_item_t *dns_cache_find(char const *name, uint32_t hash)
+{
+	int i;
+	for (i = 0; i < DNS_CACHE_SIZE; i++) {
+		struct dns_cache_item_t *item = &ip_stack_globals.dns_cache[(hash + i) % DNS_CACHE_SIZE];
+		if (item->hash == 0) {
+			break; // end of the probe sequence
+		}
+		if (item->hash == hash && strcasecmp(item->name, name) == 0) {
+			return item;
+		}
+	}
+	return 0;
+}
+
+static void dns_cache_add(char const *name, uint8_t const (*ipv4)[4], int count, uint32_t ttl)
+{
+	uint32_t hash = dns_name_hash(name);
+	uint32_t now = uptime_seconds();
+	struct dns_cache_item_t *item = dns_cache_find(name, hash);
+	int i;
+
+	if (ttl > DNS_TTL_MAX) {
+		ttl = DNS_TTL_MAX;
+	}
+	if (!item) {
+		// first unused or expired slot of the probe sequence, otherwise the one expiring soonest
+		for (i = 0; i < DNS_CACHE_SIZE; i++) {
+			struct dns_cache_item_t *p = &ip_stack_globals.dns_cache[(hash + i) % DNS_CACHE_SIZE];
+			if (p->hash == 0 || (int32_t)(p->expires - now) <= 0) {
+				item = p;
+				break;
+			}
+			if (!item || (int32_t)(p->expires - item->expires) < 0) {
+				item = p;
+			}
+		}
+	}
+	if (count > DNS_CACHE_ADDRS) {
+		count = DNS_CACHE_ADDRS;
+	}
+	item->hash = hash;
+	item->expires = now + ttl;
+	item->count = count;
+	item->next = 0;
+	memcpy(item->ipv4, ipv4, count * 4);
+	strcpy(item->name, name);
+}
+
+bool dns_cache_lookup(char const *name, uint8_t *ipv4)
+{
+	struct dns_cache_item_t *item = dns_cache_find(name, dns_name_hash(name));
+	if (!item || item->count == 0) {
+		return false;
+	}
+	if ((int32_t)(item->expires - uptime_seconds()) <= 0) {
+		item->count = 0; // keeps its slot so the probe sequence stays intact
+		return false;
+	}
+	memcpy(ipv4, item->ipv4[item->next], 4);
+	item->next = (item->next + 1) % item->count;
+	return true;
+}
+
+bool dns_cache_contains(char const *name, uint8_t const *ipv4)
+{
+	struct dns_cache_item_t *item = dns_cache_find(name, dns_name_hash(name));
+	int i;
+	if (!item || (int32_t)(item->expires - uptime_seconds()) <= 0) {
+		return false;
+	}
+	for (i = 0; i < item->count; i++) {
+		if (memcmp(item->ipv4[i], ipv4, 4) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool send_dns_query(struct dns_query_t const *q)
 {
-	uint8_t tmp[MAX_FRAME_SIZE];
 	struct frame_t {
 		struct eth_ip_udp_frame_t header;
 		struct dns_frame_t dns;
 	}  __attribute__ ((packed)) *frame;
 
+	uint8_t *tmp;
 	uint8_t *p;
-	uint8_t *end;
-	uint16_t packetlength;
+	bool ok;
 
-
-	memset(tmp, 0, sizeof(tmp));
+	tmp = borrow_frame();
+	if (!tmp) {
+		return false;
+	}
+	memset(tmp, 0, sizeof(struct frame_t));
 
 	frame = (struct frame_t *)tmp;
 	p = tmp + sizeof(struct frame_t);
-	end = tmp + MAX_FRAME_SIZE;
 
+	write_s(&frame->dns.transaction_id, q->transaction_id);
 	write_s(&frame->dns.flags, 0x0100);
 	write_s(&frame->dns.questions, 1);
 	write_s(&frame->dns.answer_rrs, 0);
 	write_s(&frame->dns.authority_rrs, 0);
 	write_s(&frame->dns.additional_rrs, 0);
 
-	char const *s = name;
+	// the name was checked by dns_query_start(), DNS_NAME_SIZE keeps it far inside the frame
+	char const *s = q->name;
 	while (*s) {
 		int n;
-		for (n = 0; s[n]; n++) {
-			if (s[n] == '.') {
-				break;
-			}
-			if (s[n] == '/') {
-				return false;
-			}
-		}
-		if (n > 255) {
-			return false;
-		}
-		if (p + 1 + n > end) {
-			return false;
-		}
+		for (n = 0; s[n] && s[n] != '.'; n++);
 		*p++ = n;
 		memcpy(p, s, n);
 		p += n;
@@ -1155,63 +1814,127 @@ bool query_dns(char const *name, uint8_t *ipv4)
 		}
 		s++;
 	}
-	if (p + 5 > end) {
-		return false;
-	}
 	*p++ = 0;
-	write_s(p, 0x0001);
+	write_s(p, 0x0001); // A
 	p += 2;
-	write_s(p, 0x0001);
+	write_s(p, 0x0001); // IN
 	p += 2;
 
-	prepare_udp_packet(&frame->header, ip_stack_globals.dns_addr, 53, 1024, p);
-	packetlength = p - tmp;
+	prepare_udp_packet(&frame->header, ip_stack_globals.dns_addr, 53, DNS_CLIENT_PORT, p);
+	ok = send_ip_packet(tmp, p - tmp) != IP_SEND_FAILED;
+	return_frame(tmp);
+	return ok;
+}
 
-	int index;
-	for (index = 0; index < DNS_CACHE_SIZE - 1; index++) {
-		if (!ip_stack_globals.dns_cache[index]) {
-			break;
+static void finish_dns_query(struct dns_query_t *q, uint8_t const *ipv4)
+{
+	if (ipv4) {
+		memcpy(q->ipv4, ipv4, 4);
+	}
+	q->status = ipv4 ? DNS_RESOLVED : DNS_FAILED;
+	if (q->handler) {
+		q->handler(q->ctx, q->name, ipv4);
+		q->status = DNS_FREE;
+	}
+}
+
+// retries driven from ip_stack_process()
+static void process_dns_queries()
+{
+	int i;
+	for (i = 0; i < DNS_QUERY_COUNT; i++) {
+		struct dns_query_t *q = &ip_stack_globals.dns_queries[i];
+		if (q->status != DNS_PENDING || milliseconds() - q->tick < DNS_RETRY_INTERVAL) {
+			continue;
+		}
+		q->retry++;
+		if (q->retry >= DNS_RETRY_COUNT || !send_dns_query(q)) {
+			finish_dns_query(q, 0);
+			continue;
 		}
+		q->tick = milliseconds();
 	}
-	struct dns_cache_item_t *item = ip_stack_globals.dns_cache[index];
-	if (item) {
-		free(item);
+}
+
+int dns_query_start(char const *name, dns_handler_t handler, void *ctx)
+{
+	int i, n;
+	struct dns_query_t *q = 0;
+
+	// labels of 1..63 characters
+	if (!name[0] || strlen(name) >= DNS_NAME_SIZE || strchr(name, '/')) {
+		return -1;
 	}
-	if (index > 0) {
-		memmove(&ip_stack_globals.dns_cache[1], ip_stack_globals.dns_cache, sizeof(struct dns_cache_item_t *) * index);
+	for (i = 0; name[i]; i += n + 1) {
+		for (n = 0; name[i + n] && name[i + n] != '.'; n++);
+		if (n < 1 || n > 63) {
+			return -1;
+		}
+		if (!name[i + n]) {
+			break;
+		}
 	}
-	int n = sizeof(struct dns_cache_item_t) + strlen(name);
-	item = (struct dns_cache_item_t *)malloc(n);
-	memset(item, 0, n);
-	strcpy(item->name, name);
-	ip_stack_globals.dns_cache[0] = item;
 
-	int retry = -1;
-	uint32_t tick = 0;
-	while (1) {
-		if (retry == -1 || milliseconds() - tick >= 5000) {
-			retry++;
-			if (retry >= 12) {
-				return false;
-			}
-			write_s(&item->transaction_id, ip_stack_globals.dns_transaction_id);
-			ip_stack_globals.dns_transaction_id++;
-			if (!send_ip_packet(tmp, packetlength)) {
-				return false;
-			}
-			tick = milliseconds();
+	for (i = 0; i < DNS_QUERY_COUNT; i++) {
+		if (ip_stack_globals.dns_queries[i].status == DNS_FREE) {
+			q = &ip_stack_globals.dns_queries[i];
+			break;
 		}
+	}
+	if (!q) {
+		return -1;
+	}
+
+	memset(q, 0, sizeof(struct dns_query_t));
+	strcpy(q->name, name);
+	q->handler = handler;
+	q->ctx = ctx;
+	q->transaction_id = ++ip_stack_globals.dns_transaction_id;
+	q->status = DNS_PENDING;
+	q->tick = milliseconds();
+	if (!send_dns_query(q)) {
+		q->status = DNS_FREE;
+		return -1;
+	}
+	return i;
+}
+
+int dns_query_poll(int id, uint8_t *ipv4)
+{
+	struct dns_query_t *q;
+	int status;
+	if (id < 0 || id >= DNS_QUERY_COUNT) {
+		return DNS_FAILED;
+	}
+	q = &ip_stack_globals.dns_queries[id];
+	status = q->status;
+	if (status == DNS_RESOLVED) {
+		memcpy(ipv4, q->ipv4, 4);
+	}
+	if (status != DNS_PENDING) {
+		q->status = DNS_FREE;
+	}
+	return status;
+}
+
+void dns_query_cancel(int id)
+{
+	if (id >= 0 && id < DNS_QUERY_COUNT) {
+		ip_stack_globals.dns_queries[id].status = DNS_FREE;
+	}
+}
+
+bool query_dns(char const *name, uint8_t *ipv4)
+{
+	int status;
+	int id = dns_query_start(name, 0, 0);
+	if (id < 0) {
+		return false;
+	}
+	while ((status = dns_query_poll(id, ipv4)) == DNS_PENDING) {
 		ip_stack_process();
-		if (ip_stack_globals.state == STATE_IDLE) {
-			for (index = 0; index < DNS_CACHE_SIZE; index++) {
-				item = ip_stack_globals.dns_cache[index];
-				if (item && item->valid_address && strcmp(item->name, name) == 0) {
-					memcpy(ipv4, item->ipv4, 4);
-					return true;
-				}
-			}
-		}
 	}
+	return status == DNS_RESOLVED;
 }
 
 bool gethostbyname(char const *name, uint8_t *ipv4)
@@ -1256,18 +1979,8 @@ bool gethostbyname(char const *name, uint8_t *ipv4)
 		}
 	}
 L1:;
-	for (i = 0; i < DNS_CACHE_SIZE; i++) {
-		struct dns_cache_item_t *item = ip_stack_globals.dns_cache[i];
-		if (item && strcmp(name, item->name) == 0) {
-			if (item->valid_address) {
-				memcpy(ipv4, item->ipv4, 4);
-				memmove(&ip_stack_globals.dns_cache[1], ip_stack_globals.dns_cache, sizeof(struct dns_cache_item_t *) * i);
-				ip_stack_globals.dns_cache[0] = item;
-				return true;
-			}
-			free(item);
-			ip_stack_globals.dns_cache[i] = 0;
-		}
+	if (dns_cache_lookup(name, ipv4)) {
+		return true;
 	}
 
 	if (query_dns(name, addr)) {
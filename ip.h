@@ -9,11 +9,30 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#ifndef IP_CHECKSUM_OFFLOAD
+#define IP_CHECKSUM_OFFLOAD 0 // 1: the network controller computes and verifies checksums
+#endif
+
+struct eth_checksum_t {
+	uint16_t begin; // offsets from the start of the frame
+	uint16_t end;
+	uint16_t field; // where the result is stored
+	uint16_t sum; // sum of the data outside the frame (udp pseudo header)
+};
+
 // provided by host program
 uint32_t milliseconds();
+uint32_t random32();
 void eth_init(uint8_t const *macaddr);
 unsigned int eth_recv_packet(void *ptr, int maxlen);
 void eth_send_packet(void const *ptr, unsigned int len);
+void eth_send_packet_csum(void const *ptr, unsigned int len, struct eth_checksum_t const *csum, int count);
+void eth_add_filter(int filter); // accept these frames in addition to unicast to our address
+void eth_remove_filter(int filter);
+
+#define ETH_FILTER_BROADCAST 0x01
+#define ETH_FILTER_MULTICAST 0x02
+#define ETH_FILTER_ARP 0x04 // broadcast ARP only
 
 //
 
@@ -25,13 +44,50 @@ struct packet_header_t {
 	uint8_t data[0];
 };
 
+struct ip_stack_stats_t {
+	uint8_t frames_in_use_max; // frame pool high-water mark
+	uint32_t frame_pool_exhausted; // frames dropped or not sent for lack of a buffer
+	uint32_t udp_ring_full; // datagrams dropped, the receive ring was full
+	uint32_t udp_too_large; // datagrams dropped, larger than a ring slot
+	uint32_t udp_no_port; // datagrams dropped, nothing bound to the destination port
+};
+
+// send results, IP_SEND_FAILED is 0 so they can be tested like a bool
+#define IP_SEND_FAILED 0
+#define IP_SEND_OK 1
+#define IP_SEND_PENDING 2 // queued until the next hop answers arp, see ip_set_send_error_handler()
+
+// dns query status
+#define DNS_FREE 0
+#define DNS_PENDING 1
+#define DNS_RESOLVED 2
+#define DNS_FAILED 3
+
+typedef void (*dns_handler_t)(void *ctx, char const *name, uint8_t const *ipv4); // ipv4 == 0: failed
+typedef void (*udp_handler_t)(void *ctx, uint8_t const *srcipv4, uint16_t srcport, uint16_t dstport, uint8_t const *data, uint16_t len);
+
 void ip_config(uint8_t const *ipv4, uint8_t const *mask, uint8_t const *gateway, uint8_t const *dns);
 void ip_stack_init(uint8_t const *macaddr);
-bool ip_config_with_dhcp();
+bool ip_config_with_dhcp(); // blocks until the first lease
+void dhcp_start(); // returns at once, the lease is acquired and renewed from ip_stack_process()
 void ip_stack_process();
-bool gethostbyname(char const *name, uint8_t *ipv4);
-bool send_udp_packet(uint8_t const *dstipv4, uint16_t dstport, uint16_t srcport, uint8_t const *ptr, uint16_t len);
-struct packet_header_t *take_udp_packet(); // after using the buffer should be free(p);
+bool gethostbyname(char const *name, uint8_t *ipv4); // blocks until resolved
+bool dns_cache_lookup(char const *name, uint8_t *ipv4); // rotates through the cached addresses, false: not cached or expired
+bool dns_cache_contains(char const *name, uint8_t const *ipv4); // among the unexpired addresses of the name, does not rotate
+uint32_t uptime_seconds();
+int dns_query_start(char const *name, dns_handler_t handler, void *ctx); // query id, -1: error. with a handler the id is released after the call
+int dns_query_poll(int id, uint8_t *ipv4); // DNS_PENDING, DNS_RESOLVED or DNS_FAILED, a finished query is released
+void dns_query_cancel(int id);
+int send_udp_packet(uint8_t const *dstipv4, uint16_t dstport, uint16_t srcport, uint8_t const *ptr, uint16_t len);
+uint8_t *reserve_udp_packet(uint16_t maxlen); // payload area of a frame from the pool, 0: too long or the pool is empty
+int commit_udp_packet(uint8_t *payload, uint8_t const *dstipv4, uint16_t dstport, uint16_t srcport, uint16_t len); // builds the headers and sends, the reservation ends either way
+bool udp_bind(uint16_t port, udp_handler_t handler, void *ctx); // handler == 0: queue for borrow_udp_packet(), call after ip_stack_init()
+void udp_unbind(uint16_t port);
+struct packet_header_t *borrow_udp_packet(); // oldest received datagram, valid until release_udp_packet()
+void release_udp_packet(struct packet_header_t *packet);
+struct packet_header_t *take_udp_packet(); // copy on the heap, after using the buffer should be free(p);
+void ip_set_send_error_handler(void (*handler)(uint8_t const *dstipv4)); // a pending send gave up, call after ip_stack_init()
+void ip_stack_get_stats(struct ip_stack_stats_t *stats);
 
 #endif
 
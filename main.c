@@ -10,9 +10,17 @@
 
 #include "lcd.h"
 #include "ip.h"
+#include "clock.h"
+#include "ntp.h"
 
 #define TIMEZONE (9 * 60 * 60)
-#define NTP_SERVER "ntp.nict.jp"
+
+// three or more servers let a falseticker be outvoted
+static char const *const ntp_servers[] = {
+	"ntp.nict.jp",
+	"ntp.jst.mfeed.ad.jp",
+	"jp.pool.ntp.org",
+};
 
 #define LED_PIN 25
 void toggle_led()
@@ -35,38 +43,6 @@ void giveup(char const *msg)
 	}
 }
 
-// NTP
-
-#define NTP_PACKET_SIZE 48
-
-void send_ntp_request(uint8_t const *ntp_server_addr)
-{
-	uint8_t data[NTP_PACKET_SIZE];
-	memset(data, 0, sizeof(data));
-	data[0] = 0xdb;
-	send_udp_packet(ntp_server_addr, 123, 1024, data, sizeof(data));
-}
-
-bool parse_ntp_packet(struct packet_header_t *packet, unsigned long *p_s, int *p_ms)
-{
-	if (!packet) {
-		return false;
-	}
-	if (packet->src_port != 123 && packet->dst_port != 123) {
-		return false;
-	}
-	if (packet->length < NTP_PACKET_SIZE) {
-		return false;
-	}
-	unsigned long s = (((unsigned long)packet->data[0x28] << 24) | ((unsigned long)packet->data[0x29] << 16) | ((unsigned long)packet->data[0x2a] << 8) | (unsigned long)packet->data[0x2b]);
-	unsigned long ms = (((unsigned long)packet->data[0x2c] << 24) | ((unsigned long)packet->data[0x2d] << 16) | ((unsigned long)packet->data[0x2e] << 8) | (unsigned long)packet->data[0x2f]);
-	ms >>= 16;
-	ms = (ms * 1000 + 32768) >> 16;
-	*p_s = s;
-	*p_ms = (int)ms;
-	return true;
-}
-
 //
 
 void convert_cjd_to_ymd(unsigned long j, int *year, int *month, int *day)
@@ -122,28 +98,16 @@ void display_date_time(struct Result const *r)
 
 //
 
-uint64_t milliseconds_diff = 0;
-
-void set_time(uint32_t s, uint16_t ms)
+uint64_t get_time()
 {
-	uint64_t m = (uint64_t)s * 1000 + ms;
-	uint64_t t = to_us_since_boot(get_absolute_time()) / 1000;
-	milliseconds_diff = m - t;
-}
-
-uint32_t get_time()
-{
-	uint64_t m = to_us_since_boot(get_absolute_time()) / 1000 + milliseconds_diff;
-	return m / 1000;
+	return clock_now_us() / 1000000;
 }
 
 //
 
 int main()
 {
-	uint32_t now = 0;
-	bool valid_time = false;
-	bool adjust_time = false;
+	uint64_t now = 0;
 
 	gpio_init(LED_PIN);
 	gpio_set_dir(LED_PIN, GPIO_OUT);
@@ -159,11 +123,12 @@ int main()
 		0xfe, 0xff, 0xff, 0x00, 0x00, 0xf0
 	};
 
-	// start networking
+	clock_init();
 
-	uint8_t ntp_server_addr[4];
+	// start networking
 
 	ip_stack_init(macaddr);
+	ntp_init(ntp_servers, sizeof(ntp_servers) / sizeof(ntp_servers[0]));
 
 #if 0
 	{
@@ -187,35 +152,14 @@ int main()
 	}
 #endif
 
-	if (!gethostbyname(NTP_SERVER, ntp_server_addr)) {
-		giveup("Resolve error");
-	}
-
 	//
 
-	adjust_time = true;
-
 	while (1) {
-		if (adjust_time) {
-			send_ntp_request(ntp_server_addr);
-			adjust_time = false;
-		}
-
 		ip_stack_process();
+		ntp_process(); // polls on its own schedule, names are resolved in the background
 
-		struct packet_header_t *packet = take_udp_packet();
-		if (packet) {
-			uint32_t s;
-			uint16_t ms;
-			if (parse_ntp_packet(packet, &s, &ms)) {
-				set_time(s, ms);
-				valid_time = true;
-			}
-			free(packet);
-		}
-
-		if (valid_time) {
-			unsigned long t = get_time();
+		if (clock_is_set()) {
+			uint64_t t = get_time(); // seconds since 1900, past 2036 too
 			if (now < t) {
 				now = t;
 				t += TIMEZONE;
@@ -228,10 +172,6 @@ int main()
 				convert_cjd_to_ymd(cjd, &r.year, &r.month, &r.day);
 
 				display_date_time(&r);
-
-				if (r.minute % 30 == 29 && r.second == 30) {
-					adjust_time = true;
-				}
 			}
 		}
 	}
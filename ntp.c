@@ -0,0 +1,590 @@
+/**
+ * Copyright (C) 2021 S.Fuchita (@soramimi_jp)
+ * MIT License
+ */
+
+#include "ntp.h"
+#include "ip.h"
+#include "clock.h"
+#include <string.h>
+
+#define NTP_PACKET_SIZE 48
+#define NTP_PRECISION 500 // us, offsets this small count as stable whatever the jitter
+#define NTP_PHI 15 // ppm, how fast the error of a sample grows with its age (rfc 5905)
+#define NTP_ERA_PIVOT 3818448000u // 2021-01-01, until the clock is set server time is taken within 68 years of it
+
+// field offsets
+#define NTP_ROOT_DELAY 0x04
+#define NTP_ROOT_DISPERSION 0x08
+#define NTP_REFERENCE_ID 0x0c // kiss code when the stratum is 0
+#define NTP_ORIGIN 0x18 // T1, echoed by the server
+#define NTP_RECEIVE 0x20 // T2
+#define NTP_TRANSMIT 0x28 // T3
+
+struct ntp_sample_t {
+	int64_t offset; // microseconds to add to the local clock
+	int64_t delay; // round trip, microseconds
+	uint32_t tick; // milliseconds() on arrival
+};
+
+struct ntp_source_t {
+	char const *name;
+	uint8_t addr[4];
+	bool resolved;
+	bool resolving;
+	// outstanding request
+	bool pending;
+	uint8_t origin[8]; // transmit timestamp as sent, the reply has to echo it
+	uint64_t t1; // local clock, microseconds since 1900
+	uint32_t sent_tick;
+	// schedule
+	uint32_t next_poll; // milliseconds()
+	int burst; // exchanges left at NTP_BURST_INTERVAL
+	int poll_min; // raised by kiss-o'-death RATE
+	bool denied;
+	// clock filter
+	struct ntp_sample_t samples[NTP_FILTER_SIZE];
+	int sample_count;
+	int sample_next;
+	uint8_t reach;
+	uint8_t polls; // since the name was resolved, saturates at 8
+	int64_t root_distance; // us, root delay / 2 + root dispersion of the last reply
+	int64_t offset;
+	int64_t delay;
+	int64_t jitter;
+	uint32_t sample_tick; // of the sample offset and delay come from
+	bool selected;
+};
+
+struct ntp_globals_t {
+	struct ntp_source_t sources[NTP_SOURCE_COUNT];
+	int count;
+	int poll; // log2 seconds, shared by all servers
+	int poll_count; // hysteresis of poll changes
+	bool update; // new samples since the last clock update
+	uint32_t update_tick; // milliseconds() of the last clock update
+};
+
+static struct ntp_globals_t ntp_globals;
+
+static uint64_t isqrt(uint64_t n)
+{
+	uint64_t r = 0;
+	uint64_t b = (uint64_t)1 << 62;
+	while (b > n) {
+		b >>= 2;
+	}
+	while (b) {
+		if (n >= r + b) {
+			n -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+		b >>= 2;
+	}
+	return r;
+}
+
+static uint64_t square(int64_t v)
+{
+	if (v > 1000000000 || v < -1000000000) {
+		v = 1000000000; // keeps the sums in range, anything this far off is rejected anyway
+	}
+	return (uint64_t)(v * v);
+}
+
+static uint32_t read_ntp_long(uint8_t const *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// the seconds wrap every 136 years (era 1 starts in 2036), the era is the one closest to reference
+static uint64_t read_ntp_timestamp(uint8_t const *p, uint64_t reference) // microseconds since 1900
+{
+	uint32_t s = read_ntp_long(p);
+	uint32_t f = read_ntp_long(p + 4);
+	uint64_t r = reference / 1000000;
+	uint64_t seconds = r + (int32_t)(s - (uint32_t)r);
+	return seconds * 1000000 + (((uint64_t)f * 1000000) >> 32);
+}
+
+static void write_ntp_timestamp(uint8_t *p, uint64_t us)
+{
+	uint32_t s = us / 1000000; // the era is dropped
+	uint32_t f = (((us % 1000000) << 32) + 999999) / 1000000; // rounded up, reads back as the same microsecond
+	f |= random32() & 0x7ff; // below half a microsecond, makes the origin hard to guess
+	p[0] = s >> 24;
+	p[1] = s >> 16;
+	p[2] = s >> 8;
+	p[3] = s;
+	p[4] = f >> 24;
+	p[5] = f >> 16;
+	p[6] = f >> 8;
+	p[7] = f;
+}
+
+// IP_SEND_PENDING: held for arp, it leaves later than t1 says, so no reply is expected for it
+static int send_ntp_request(struct ntp_source_t *src)
+{
+	int r;
+	uint8_t *data = reserve_udp_packet(NTP_PACKET_SIZE);
+	if (!data) {
+		return IP_SEND_FAILED;
+	}
+	memset(data, 0, NTP_PACKET_SIZE);
+	data[0] = 0x23; // li=0, version=4, mode=3 (client)
+	src->t1 = clock_now_us();
+	write_ntp_timestamp(data + NTP_TRANSMIT, src->t1);
+	memcpy(src->origin, data + NTP_TRANSMIT, 8);
+	r = commit_udp_packet(data, src->addr, 123, NTP_LOCAL_PORT, NTP_PACKET_SIZE);
+	src->pending = r == IP_SEND_OK;
+	return r;
+}
+
+static int ntp_source_poll(struct ntp_source_t const *src)
+{
+	return src->poll_min > ntp_globals.poll ? src->poll_min : ntp_globals.poll;
+}
+
+// +-1/8 around the poll interval, so clocks started together do not keep asking together
+static uint32_t ntp_randomized_interval(int poll)
+{
+	uint32_t ms = 1000u << poll;
+	return ms - ms / 8 + random32() % (ms / 4);
+}
+
+static void ntp_kiss(struct ntp_source_t *src, uint8_t const *code)
+{
+	if (memcmp(code, "RATE", 4) == 0) {
+		// back off from what we asked at, the burst stops too
+		int poll = ntp_source_poll(src) + 1;
+		src->poll_min = poll < NTP_KOD_MAXPOLL ? poll : NTP_KOD_MAXPOLL;
+		src->burst = 0;
+		src->next_poll = milliseconds() + ntp_randomized_interval(src->poll_min);
+	} else if (memcmp(code, "DENY", 4) == 0 || memcmp(code, "RSTR", 4) == 0) {
+		src->denied = true;
+	}
+}
+
+// t4: local clock when the reply arrived
+static bool parse_ntp_packet(struct ntp_source_t *src, uint8_t const *data, uint16_t len, uint64_t t4, struct ntp_sample_t *sample)
+{
+	if (len < NTP_PACKET_SIZE || memcmp(data + NTP_ORIGIN, src->origin, 8) != 0) {
+		return false; // not the reply to our request
+	}
+	if ((data[0] & 7) != 4) {
+		return false; // not a server
+	}
+	src->pending = false; // a duplicate would be matched against a stale t1
+	if (data[1] == 0) {
+		ntp_kiss(src, data + NTP_REFERENCE_ID); // trusted only now that the origin matched
+		return false;
+	}
+	if ((data[0] >> 6) == 3 || data[1] >= 16) {
+		return false; // not synchronized
+	}
+	int64_t t1 = src->t1;
+	uint64_t reference = clock_is_set() ? src->t1 : (uint64_t)NTP_ERA_PIVOT * 1000000;
+	int64_t t2 = read_ntp_timestamp(data + NTP_RECEIVE, reference);
+	int64_t t3 = read_ntp_timestamp(data + NTP_TRANSMIT, reference);
+	sample->offset = ((t2 - t1) + (t3 - (int64_t)t4)) / 2;
+	sample->delay = ((int64_t)t4 - t1) - (t3 - t2);
+	if (sample->delay < 0) {
+		sample->delay = 0; // server processing measured with a coarser clock than ours
+	}
+	// 16.16 seconds
+	src->root_distance = (((uint64_t)read_ntp_long(data + NTP_ROOT_DELAY) * 1000000) >> 17) + (((uint64_t)read_ntp_long(data + NTP_ROOT_DISPERSION) * 1000000) >> 16);
+	return true;
+}
+
+// us a sample may have drifted since it was taken
+static int64_t ntp_age_error(uint32_t tick)
+{
+	return (int64_t)(milliseconds() - tick) * NTP_PHI / 1000;
+}
+
+// the sample with the least delay is the least disturbed by queueing, jitter is rms against it.
+// older samples say less about the clock as it is now
+static void ntp_filter(struct ntp_source_t *src, struct ntp_sample_t const *sample)
+{
+	int i;
+	struct ntp_sample_t const *best;
+	uint64_t sum = 0;
+
+	src->samples[src->sample_next] = *sample;
+	src->sample_next = (src->sample_next + 1) % NTP_FILTER_SIZE;
+	if (src->sample_count < NTP_FILTER_SIZE) {
+		src->sample_count++;
+	}
+
+	best = &src->samples[0];
+	for (i = 1; i < src->sample_count; i++) {
+		if (src->samples[i].delay / 2 + ntp_age_error(src->samples[i].tick) < best->delay / 2 + ntp_age_error(best->tick)) {
+			best = &src->samples[i];
+		}
+	}
+	for (i = 0; i < src->sample_count; i++) {
+		sum += square(src->samples[i].offset - best->offset);
+	}
+	src->offset = best->offset;
+	src->delay = best->delay;
+	src->sample_tick = best->tick;
+	src->jitter = src->sample_count > 1 ? isqrt(sum / (src->sample_count - 1)) : 0;
+}
+
+static void on_ntp_packet(void *ctx, uint8_t const *srcipv4, uint16_t srcport, uint16_t dstport, uint8_t const *data, uint16_t len)
+{
+	uint64_t t4 = clock_now_us();
+	struct ntp_sample_t sample;
+	int i;
+	if (srcport != 123) {
+		return;
+	}
+	for (i = 0; i < ntp_globals.count; i++) {
+		struct ntp_source_t *src = &ntp_globals.sources[i];
+		if (src->pending && memcmp(srcipv4, src->addr, 4) == 0 && parse_ntp_packet(src, data, len, t4, &sample)) {
+			sample.offset -= clock_pending(); // against the clock as it reads once the correction is done
+			sample.tick = milliseconds();
+			ntp_filter(src, &sample);
+			src->reach |= 1;
+			ntp_globals.update = true;
+			return;
+		}
+	}
+}
+
+// the samples so far are of another server, or too old to count
+static void ntp_source_forget(struct ntp_source_t *src)
+{
+	src->polls = 0;
+	src->sample_count = 0;
+	src->sample_next = 0;
+}
+
+// a resolved source keeps its address, ntp_send() compares it with the records while they are valid
+static void on_ntp_server_resolved(void *ctx, char const *name, uint8_t const *ipv4)
+{
+	struct ntp_source_t *src = (struct ntp_source_t *)ctx;
+	src->resolving = false;
+	if (ipv4 && !src->resolved) {
+		memcpy(src->addr, ipv4, 4);
+		src->resolved = true;
+	}
+}
+
+static int64_t ntp_distance(struct ntp_source_t const *src)
+{
+	return src->delay / 2 + src->root_distance + src->jitter + ntp_age_error(src->sample_tick) + 1;
+}
+
+// marzullo: the smallest interval that is consistent with as many servers as possible, at least a majority
+static int ntp_select(struct ntp_source_t **list, int n)
+{
+	int f, i, j, k;
+	int64_t low = 0;
+	int64_t high = 0;
+
+	for (f = 0; 2 * f < n; f++) {
+		int need = n - f;
+		bool found_low = false;
+		bool found_high = false;
+		for (i = 0; i < n; i++) {
+			int64_t lo = list[i]->offset - ntp_distance(list[i]);
+			int64_t hi = list[i]->offset + ntp_distance(list[i]);
+			int lo_count = 0;
+			int hi_count = 0;
+			for (j = 0; j < n; j++) {
+				int64_t a = list[j]->offset - ntp_distance(list[j]);
+				int64_t b = list[j]->offset + ntp_distance(list[j]);
+				if (a <= lo && lo <= b) {
+					lo_count++;
+				}
+				if (a <= hi && hi <= b) {
+					hi_count++;
+				}
+			}
+			if (lo_count >= need && (!found_low || lo < low)) {
+				low = lo;
+				found_low = true;
+			}
+			if (hi_count >= need && (!found_high || hi > high)) {
+				high = hi;
+				found_high = true;
+			}
+		}
+		if (found_low && found_high && low <= high) {
+			break;
+		}
+	}
+	if (2 * f >= n) {
+		return 0; // no majority agrees
+	}
+
+	// falsetickers do not reach the intersection
+	k = 0;
+	for (i = 0; i < n; i++) {
+		if (list[i]->offset + ntp_distance(list[i]) >= low && list[i]->offset - ntp_distance(list[i]) <= high) {
+			list[k++] = list[i];
+		}
+	}
+	return k;
+}
+
+// drop the survivor farthest from the rest while that spread exceeds the jitter of the best server
+static int ntp_cluster(struct ntp_source_t **list, int n)
+{
+	int i, j;
+	while (n > NTP_MIN_CLUSTER) {
+		int worst = 0;
+		uint64_t worst_spread = 0;
+		uint64_t min_jitter = UINT64_MAX;
+		for (i = 0; i < n; i++) {
+			uint64_t spread = 0;
+			for (j = 0; j < n; j++) {
+				spread += square(list[j]->offset - list[i]->offset);
+			}
+			spread /= n - 1;
+			if (spread > worst_spread) {
+				worst_spread = spread;
+				worst = i;
+			}
+			if (square(list[i]->jitter) < min_jitter) {
+				min_jitter = square(list[i]->jitter);
+			}
+		}
+		if (worst_spread <= min_jitter) {
+			break;
+		}
+		for (i = worst; i + 1 < n; i++) {
+			list[i] = list[i + 1];
+		}
+		n--;
+	}
+	return n;
+}
+
+// weighted by 1 / distance^2, so a server whose samples just jumped (wide interval) barely pulls.
+// relative to the first survivor to keep the products small.
+// *age: when the result was measured, as the same weighted mean, us ago
+static int64_t ntp_combine(struct ntp_source_t **list, int n, int64_t *age)
+{
+	uint32_t now = milliseconds();
+	int i;
+	int64_t sum = 0;
+	int64_t age_sum = 0;
+	int64_t weight = 0;
+	for (i = 0; i < n; i++) {
+		int64_t d = ntp_distance(list[i]);
+		int64_t w;
+		if (d < NTP_PRECISION) {
+			d = NTP_PRECISION;
+		}
+		w = 1000000000000 / d / d;
+		if (w < 1) {
+			w = 1; // beyond a second, still admitted up to NTP_MAX_DISTANCE
+		}
+		sum += (list[i]->offset - list[0]->offset) * w;
+		age_sum += (int64_t)(now - list[i]->sample_tick) * w; // ms
+		weight += w;
+	}
+	if (weight == 0) {
+		*age = (int64_t)(now - list[0]->sample_tick) * 1000;
+		return list[0]->offset;
+	}
+	*age = age_sum / weight * 1000;
+	return list[0]->offset + sum / weight;
+}
+
+// longer intervals while the offsets stay within the noise, shorter as soon as they do not
+static void ntp_adjust_poll(int64_t offset, struct ntp_source_t **list, int n)
+{
+	uint64_t sum = 0;
+	int64_t jitter;
+	int i;
+	for (i = 0; i < n; i++) {
+		sum += square(list[i]->jitter);
+	}
+	jitter = isqrt(sum / n);
+	if (jitter < NTP_PRECISION) {
+		jitter = NTP_PRECISION;
+	}
+	if (offset < 4 * jitter && offset > -4 * jitter) {
+		if (++ntp_globals.poll_count >= 4) {
+			ntp_globals.poll_count = 0;
+			if (ntp_globals.poll < NTP_MAXPOLL) {
+				ntp_globals.poll++;
+			}
+		}
+	} else {
+		ntp_globals.poll_count = 0;
+		if (ntp_globals.poll > NTP_MINPOLL) {
+			ntp_globals.poll--;
+		}
+	}
+}
+
+static void ntp_update_clock()
+{
+	struct ntp_source_t *list[NTP_SOURCE_COUNT];
+	int64_t offset;
+	int64_t age;
+	bool fresh = false;
+	bool burst = false;
+	int i, j, n;
+
+	n = 0;
+	for (i = 0; i < ntp_globals.count; i++) {
+		struct ntp_source_t *src = &ntp_globals.sources[i];
+		src->selected = false;
+		if ((src->reach & 0x07) && src->sample_count > 0 && ntp_distance(src) < NTP_MAX_DISTANCE) {
+			list[n++] = src;
+		}
+	}
+	n = ntp_select(list, n);
+	n = ntp_cluster(list, n);
+	if (n == 0) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		list[i]->selected = true;
+		burst |= list[i]->burst > 0;
+		fresh |= (int32_t)(list[i]->sample_tick - ntp_globals.update_tick) > 0;
+	}
+	if (!fresh && clock_is_set()) {
+		return; // nothing measured since the last update
+	}
+
+	offset = ntp_combine(list, n, &age);
+	clock_update(offset, age);
+	ntp_globals.update_tick = milliseconds();
+	if (!burst) {
+		ntp_adjust_poll(offset, list, n);
+	}
+
+	// the stored samples were taken against the clock before this correction
+	for (i = 0; i < ntp_globals.count; i++) {
+		struct ntp_source_t *src = &ntp_globals.sources[i];
+		for (j = 0; j < src->sample_count; j++) {
+			src->samples[j].offset -= offset;
+		}
+		src->offset -= offset;
+	}
+}
+
+void ntp_init(char const *const *names, int count)
+{
+	int i;
+	memset(&ntp_globals, 0, sizeof(ntp_globals));
+	if (count > NTP_SOURCE_COUNT) {
+		count = NTP_SOURCE_COUNT;
+	}
+	for (i = 0; i < count; i++) {
+		struct ntp_source_t *src = &ntp_globals.sources[i];
+		src->name = names[i];
+		src->burst = NTP_BURST;
+		src->next_poll = milliseconds() + random32() % 1000;
+	}
+	ntp_globals.count = count;
+	ntp_globals.poll = NTP_MINPOLL;
+	udp_bind(NTP_LOCAL_PORT, on_ntp_packet, 0);
+}
+
+static void ntp_send(struct ntp_source_t *src, uint32_t now)
+{
+	uint8_t addr[4];
+	if (src->resolved && src->reach == 0 && src->polls >= 8) {
+		// silent for 8 polls, the name may point elsewhere by now
+		src->resolved = false;
+		ntp_source_forget(src);
+		src->burst = NTP_BURST;
+	}
+	if (src->resolved) {
+		if (!dns_cache_lookup(src->name, addr)) {
+			// the ttl ran out, keep asking the old address until the name resolves again
+			if (!src->resolving && dns_query_start(src->name, on_ntp_server_resolved, src) >= 0) {
+				src->resolving = true;
+			}
+		} else if (!dns_cache_contains(src->name, src->addr)) {
+			// the name no longer lists our server, take the next of its records without a burst
+			memcpy(src->addr, addr, 4);
+			ntp_source_forget(src);
+		}
+	}
+	if (!src->resolved) {
+		if (dns_cache_lookup(src->name, src->addr)) {
+			src->resolved = true;
+		} else {
+			if (!src->resolving && dns_query_start(src->name, on_ntp_server_resolved, src) >= 0) {
+				src->resolving = true;
+			}
+			src->next_poll = now + NTP_BURST_INTERVAL;
+			return;
+		}
+	}
+	src->reach <<= 1;
+	if (src->polls < 8) {
+		src->polls++;
+	}
+	if (send_ntp_request(src) == IP_SEND_PENDING) {
+		src->next_poll = now + NTP_BURST_INTERVAL; // ask again once the address is known
+		return;
+	}
+	src->sent_tick = now;
+	if (src->burst > 0) {
+		src->burst--;
+		src->next_poll = now + NTP_BURST_INTERVAL;
+	} else {
+		src->next_poll = now + ntp_randomized_interval(ntp_source_poll(src));
+	}
+}
+
+int ntp_poll_interval()
+{
+	return ntp_globals.poll;
+}
+
+void ntp_process()
+{
+	uint32_t now = milliseconds();
+	bool pending = false;
+	int i;
+	for (i = 0; i < ntp_globals.count; i++) {
+		struct ntp_source_t *src = &ntp_globals.sources[i];
+		if (src->pending && now - src->sent_tick >= NTP_REPLY_TIMEOUT) {
+			src->pending = false; // lost, the reach bit stays clear
+		}
+		if (!src->denied && (int32_t)(now - src->next_poll) >= 0) {
+			ntp_send(src, now);
+		}
+		pending |= src->pending;
+	}
+	// servers asked together are combined together
+	if (ntp_globals.update && !pending) {
+		ntp_globals.update = false;
+		ntp_update_clock();
+	}
+}
+
+bool ntp_source_info(int i, struct ntp_source_info_t *info)
+{
+	struct ntp_source_t const *src;
+	if (i < 0 || i >= ntp_globals.count) {
+		return false;
+	}
+	src = &ntp_globals.sources[i];
+	info->name = src->name;
+	if (src->resolved) {
+		memcpy(info->addr, src->addr, 4);
+	} else {
+		memset(info->addr, 0, 4);
+	}
+	info->reach = src->reach;
+	info->offset = src->offset;
+	info->delay = src->delay;
+	info->jitter = src->jitter;
+	info->selected = src->selected;
+	info->denied = src->denied;
+	info->poll = ntp_source_poll(src);
+	return true;
+}
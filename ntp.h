@@ -0,0 +1,49 @@
+/**
+ * Copyright (C) 2021 S.Fuchita (@soramimi_jp)
+ * MIT License
+ */
+
+#ifndef NTP_H
+#define NTP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef NTP_SOURCE_COUNT
+#define NTP_SOURCE_COUNT 4 // servers queried at the same time
+#endif
+
+#define NTP_FILTER_SIZE 8 // samples kept per server
+#define NTP_LOCAL_PORT 1024
+#define NTP_REPLY_TIMEOUT 2000 // ms, an unanswered request is given up after this
+
+#ifndef NTP_MINPOLL
+#define NTP_MINPOLL 6 // log2 seconds, 64 s
+#endif
+#ifndef NTP_MAXPOLL
+#define NTP_MAXPOLL 10 // 1024 s
+#endif
+#define NTP_KOD_MAXPOLL 17 // a rate limiting server may push a source this far
+#define NTP_BURST 4 // exchanges at startup and when a server comes back
+#define NTP_BURST_INTERVAL 2000 // ms
+#define NTP_MIN_CLUSTER 3 // survivors the cluster algorithm does not prune below
+#define NTP_MAX_DISTANCE 1500000 // us, servers farther than this are not selected
+
+struct ntp_source_info_t {
+	char const *name;
+	uint8_t addr[4]; // zero until resolved
+	uint8_t reach; // bit 0: the last poll was answered
+	int64_t offset; // us, from the sample with the least delay, allowing for age
+	int64_t delay; // us
+	int64_t jitter; // us
+	bool selected; // survived intersection and clustering in the last update
+	bool denied; // told by kiss-o'-death not to ask again
+	int poll; // log2 seconds
+};
+
+void ntp_init(char const *const *names, int count); // the names are referenced, not copied. call after ip_stack_init()
+int ntp_poll_interval(); // log2 seconds, widens as the clock settles
+void ntp_process(); // call from the main loop, after ip_stack_process(). sends the scheduled requests and updates the clock
+bool ntp_source_info(int i, struct ntp_source_info_t *info); // false: no such server
+
+#endif